@@ -0,0 +1,52 @@
+#include "aot.h"
+
+#include <dlfcn.h>
+
+#include <cstddef>
+
+static_assert(offsetof(AotState, registers) == 0, "AotState is an ABI");
+static_assert(offsetof(AotState, memory) == 64, "AotState is an ABI");
+static_assert(offsetof(AotState, instruction_count) == 72,
+              "AotState is an ABI");
+static_assert(offsetof(AotState, program_counter) == 80,
+              "AotState is an ABI");
+static_assert(offsetof(AotState, dirty_pages) == 88, "AotState is an ABI");
+static_assert(offsetof(AotState, instruction_limit) == 96,
+              "AotState is an ABI");
+
+RecompiledRom::RecompiledRom(void *handle, aot_run_t run,
+                             std::uint64_t rom_hash)
+    : handle_(handle), run_(run), rom_hash_(rom_hash) {}
+
+RecompiledRom::~RecompiledRom() { dlclose(handle_); }
+
+std::unique_ptr<RecompiledRom> RecompiledRom::Open(const std::string &path,
+                                                   const Rom &rom) {
+  // dlopen only treats names containing a slash as paths
+  std::string file = path.find('/') == std::string::npos ? "./" + path : path;
+  void *handle = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (handle == nullptr) {
+    warn(dlerror());
+    return nullptr;
+  }
+
+  auto version =
+      static_cast<const int *>(dlsym(handle, AOT_ABI_VERSION_SYMBOL));
+  auto hash =
+      static_cast<const std::uint64_t *>(dlsym(handle, AOT_ROM_HASH_SYMBOL));
+  auto run = reinterpret_cast<aot_run_t>(dlsym(handle, AOT_RUN_SYMBOL));
+
+  if (version == nullptr || hash == nullptr || run == nullptr) {
+    warn("Recompiled ROM is missing symbols, ignoring it.");
+  } else if (*version != AOT_ABI_VERSION) {
+    warn("Recompiled ROM was built for another ABI version, ignoring it.");
+  } else if (*hash != rom.hash()) {
+    warn("Recompiled ROM doesn't match the loaded ROM, ignoring it.");
+  } else {
+    return std::unique_ptr<RecompiledRom>(
+        new RecompiledRom(handle, run, *hash));
+  }
+
+  dlclose(handle);
+  return nullptr;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "rom.h"
+#include "types.h"
+
+/*
+ * ABI between unengine and ROMs translated ahead of time by `recompile`.
+ * Bump AOT_ABI_VERSION whenever AotState or the exported symbols change.
+ */
+constexpr int AOT_ABI_VERSION = 4;
+
+struct AotState {
+  register_value_t registers[32];
+  // the 64 KiB address space; generated code only touches RAM through it
+  byte_t *memory;
+  std::uint64_t instruction_count;
+  register_value_t program_counter;
+  // Memory's dirty page map; stores set the entry of the page they hit
+  byte_t *dirty_pages;
+  // jumps back return once instruction_count gets here
+  std::uint64_t instruction_limit;
+};
+
+/*
+ * runs from program_counter and returns when it reaches 0, when the
+ * instruction at program_counter has to be run by the interpreter (MMIO and
+ * ROM accesses, invalid opcodes, jumps to code it doesn't know), or at a jump
+ * back once instruction_limit is reached.
+ */
+using aot_run_t = void (*)(AotState *);
+
+#define AOT_RUN_SYMBOL "unengine_aot_run"
+#define AOT_ABI_VERSION_SYMBOL "unengine_aot_abi_version"
+#define AOT_ROM_HASH_SYMBOL "unengine_aot_rom_hash"
+
+// A shared object produced from recompile's output, loaded with dlopen.
+class RecompiledRom {
+ private:
+  void *handle_;
+  aot_run_t run_;
+  std::uint64_t rom_hash_;
+
+  RecompiledRom(void *handle, aot_run_t run, std::uint64_t rom_hash);
+
+ public:
+  ~RecompiledRom();
+  RecompiledRom(const RecompiledRom &) = delete;
+  RecompiledRom &operator=(const RecompiledRom &) = delete;
+
+  std::uint64_t rom_hash() const { return rom_hash_; }
+  void run(AotState *state) const { run_(state); }
+
+  // returns nullptr (with a warning) if the library can't be loaded, was
+  // built for another ABI version or was translated from a different ROM
+  static std::unique_ptr<RecompiledRom> Open(const std::string &path,
+                                             const Rom &rom);
+};
@@ -0,0 +1,361 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "controller.h"
+#include "emulator.h"
+#include "rom.h"
+#include "types.h"
+
+/*
+ * Runs many short deterministic sessions in one process, on a pool of
+ * worker threads with one Emulator per session. The manifest lists one
+ * session per line (blank lines and # comments are skipped):
+ *
+ *   <rom file> <frames> [input script]
+ *
+ * An input script holds one "<frame> <buttons>" line per input change,
+ * where buttons are joined with + (e.g. UP+A) or are - for none. They stay
+ * held from that frame until the next line.
+ */
+
+struct InputChange {
+  std::uint64_t frame;
+  std::uint8_t buttons;
+};
+
+using InputScript = std::vector<InputChange>;
+
+struct Session {
+  std::string rom_file;
+  std::uint64_t frames;
+  std::string script_file;
+  // point into the maps in main; every session of a ROM shares its image
+  const Rom *rom;
+  const InputScript *script;
+};
+
+// what main prints for a session. the frame and output themselves are
+// written out by the worker, if at all, so results stay small however many
+// sessions there are
+struct SessionResult {
+  std::uint64_t frames;
+  std::uint64_t instructions;
+  BudgetStats budget;
+  bool stopped;
+  std::uint64_t framebuffer_hash;
+  std::uint64_t output_hash;
+  // false if the output files couldn't be written
+  bool written;
+};
+
+static bool parse_buttons(const std::string &text, std::uint8_t &buttons) {
+  static const std::pair<const char *, ControllerButton> names[] = {
+      {"RIGHT", RIGHT}, {"LEFT", LEFT},     {"DOWN", DOWN}, {"UP", UP},
+      {"START", START}, {"SELECT", SELECT}, {"B", B},       {"A", A},
+  };
+
+  buttons = 0;
+  if (text == "-") return true;
+
+  std::istringstream in(text);
+  std::string name;
+  while (std::getline(in, name, '+')) {
+    auto it = std::find_if(std::begin(names), std::end(names),
+                           [&](const auto &n) { return name == n.first; });
+    if (it == std::end(names)) return false;
+    buttons |= it->second;
+  }
+  return true;
+}
+
+static bool read_script(const std::string &filename, InputScript &script) {
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    std::cerr << "Error opening file: " << filename << std::endl;
+    return false;
+  }
+
+  std::string line;
+  for (int number = 1; std::getline(file, line); number++) {
+    std::istringstream fields(line);
+    std::string buttons;
+    InputChange change;
+    if (line.empty() || line[0] == '#') continue;
+    if (!(fields >> change.frame >> buttons) ||
+        !parse_buttons(buttons, change.buttons) ||
+        (!script.empty() && change.frame < script.back().frame)) {
+      std::cerr << filename << ":" << number << ": bad input line."
+                << std::endl;
+      return false;
+    }
+    script.push_back(change);
+  }
+  return true;
+}
+
+static bool read_manifest(const std::string &filename,
+                          std::vector<Session> &sessions) {
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    std::cerr << "Error opening file: " << filename << std::endl;
+    return false;
+  }
+
+  std::string line;
+  for (int number = 1; std::getline(file, line); number++) {
+    std::istringstream fields(line);
+    Session session{};
+    if (line.empty() || line[0] == '#') continue;
+    if (!(fields >> session.rom_file >> session.frames) ||
+        session.frames == 0) {
+      std::cerr << filename << ":" << number << ": bad session line."
+                << std::endl;
+      return false;
+    }
+    fields >> session.script_file;
+    sessions.push_back(session);
+  }
+  return true;
+}
+
+// writes session `index`'s stdout, stderr and last frame into directory
+static bool write_outputs(const std::string &directory, size_t index,
+                          const std::string &out_text,
+                          const std::string &err_text,
+                          const byte_t *framebuffer) {
+  std::string base = directory + "/" + std::to_string(index);
+  std::ofstream out(base + ".out", std::ios::binary);
+  std::ofstream err(base + ".err", std::ios::binary);
+  std::ofstream frame(base + ".pgm", std::ios::binary);
+  if (!out.is_open() || !err.is_open() || !frame.is_open()) {
+    std::cerr << "Error opening output files: " << base << ".*" << std::endl;
+    return false;
+  }
+
+  out << out_text;
+  err << err_text;
+  frame << "P5\n" << WindowWidth << " " << WindowHeight << "\n255\n";
+  frame.write(reinterpret_cast<const char *>(framebuffer), WindowArea);
+  return true;
+}
+
+static void run_session(const Session &session, size_t index,
+                        InterpreterCore core, const InstructionBudget &budget,
+                        const char *output_dir, SessionResult &result) {
+  std::istringstream in;
+  std::ostringstream out, err;
+  Emulator emu(in, out, err);
+  emu.set_interpreter_core(core);
+  emu.set_instruction_budget(budget);
+
+  emu.reset(*session.rom);
+
+  // steps from one input change to the next
+  ControllerState cont;
+  auto change = session.script->begin();
+  while (!emu.is_halted() && emu.get_frame_count() < session.frames) {
+    for (; change != session.script->end() &&
+           change->frame <= emu.get_frame_count();
+         change++) {
+      cont = ControllerState();
+      cont.push_button(static_cast<ControllerButton>(change->buttons));
+    }
+    std::uint64_t until = change == session.script->end()
+                              ? session.frames
+                              : std::min(change->frame, session.frames);
+    emu.step_frames(until - emu.get_frame_count(), cont);
+  }
+
+  result.stopped = emu.is_halted();
+  result.frames = emu.get_frame_count();
+  result.instructions = emu.get_instruction_count();
+  result.budget = emu.get_budget_stats();
+  result.framebuffer_hash = fnv1a(FNV1A_BASIS, emu.get_vram(), WindowArea);
+  std::string out_text = out.str();
+  result.output_hash =
+      fnv1a(FNV1A_BASIS, reinterpret_cast<const byte_t *>(out_text.data()),
+            out_text.size());
+  result.written = output_dir == nullptr ||
+                   write_outputs(output_dir, index, out_text, err.str(),
+                                 emu.get_vram());
+}
+
+// A worker's sessions. Owners take from the front, thieves from the back.
+class WorkQueue {
+ private:
+  std::mutex mutex_;
+  std::deque<size_t> sessions_;
+
+ public:
+  void push(size_t session) { sessions_.push_back(session); }
+
+  bool take(size_t &session) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (sessions_.empty()) return false;
+    session = sessions_.front();
+    sessions_.pop_front();
+    return true;
+  }
+
+  bool steal(size_t &session) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (sessions_.empty()) return false;
+    session = sessions_.back();
+    sessions_.pop_back();
+    return true;
+  }
+};
+
+static void run_sessions(const std::vector<Session> &sessions,
+                         InterpreterCore core, const InstructionBudget &budget,
+                         const char *output_dir, unsigned jobs,
+                         std::vector<SessionResult> &results) {
+  std::vector<WorkQueue> queues(jobs);
+  for (size_t i = 0; i < sessions.size(); i++) queues[i % jobs].push(i);
+
+  // all sessions are queued up front, so a worker that finds every queue
+  // empty is done
+  auto worker = [&](unsigned id) {
+    size_t session;
+    for (;;) {
+      bool found = queues[id].take(session);
+      for (unsigned i = 1; !found && i < jobs; i++) {
+        found = queues[(id + i) % jobs].steal(session);
+      }
+      if (!found) return;
+      run_session(sessions[session], session, core, budget, output_dir,
+                  results[session]);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned id = 0; id < jobs; id++) threads.emplace_back(worker, id);
+  for (std::thread &thread : threads) thread.join();
+}
+
+static int usage(const char *program) {
+  std::cerr << "usage: " << program
+            << " [--core=switch|threaded|jit] [--jobs=N] [--output-dir=DIR]"
+               " [--budget=N] [--setup-budget=N] [--overrun=abort|carry|drop]"
+               " <manifest file>."
+            << std::endl;
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  const char *manifest = nullptr;
+  const char *output_dir = nullptr;
+  InterpreterCore core = InterpreterCore::Threaded;
+  unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+  // a stuck ROM only ties up its worker until the budget runs out
+  InstructionBudget budget;
+
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--core=switch") == 0) {
+      core = InterpreterCore::Switch;
+    } else if (std::strcmp(argv[i], "--core=threaded") == 0) {
+      core = InterpreterCore::Threaded;
+    } else if (std::strcmp(argv[i], "--core=jit") == 0) {
+      core = InterpreterCore::Jit;
+    } else if (std::strncmp(argv[i], "--jobs=", 7) == 0) {
+      char *end;
+      jobs = std::strtoul(argv[i] + 7, &end, 10);
+      if (*end != '\0' || jobs == 0) return usage(argv[0]);
+    } else if (std::strncmp(argv[i], "--output-dir=", 13) == 0) {
+      output_dir = argv[i] + 13;
+    } else if (std::strncmp(argv[i], "--budget=", 9) == 0) {
+      char *end;
+      budget.frame = std::strtoull(argv[i] + 9, &end, 10);
+      if (*end != '\0' || budget.frame == 0) return usage(argv[0]);
+    } else if (std::strncmp(argv[i], "--setup-budget=", 15) == 0) {
+      char *end;
+      budget.setup = std::strtoull(argv[i] + 15, &end, 10);
+      if (*end != '\0' || budget.setup == 0) return usage(argv[0]);
+    } else if (std::strcmp(argv[i], "--overrun=abort") == 0) {
+      budget.policy = OverrunPolicy::Abort;
+    } else if (std::strcmp(argv[i], "--overrun=carry") == 0) {
+      budget.policy = OverrunPolicy::Carry;
+    } else if (std::strcmp(argv[i], "--overrun=drop") == 0) {
+      budget.policy = OverrunPolicy::Drop;
+    } else if (argv[i][0] == '-' || manifest != nullptr) {
+      return usage(argv[0]);
+    } else {
+      manifest = argv[i];
+    }
+  }
+
+  if (manifest == nullptr) return usage(argv[0]);
+
+  std::vector<Session> sessions;
+  if (!read_manifest(manifest, sessions)) return 1;
+
+  // each ROM and script is read once, however many sessions use it
+  std::map<std::string, Rom> roms;
+  std::map<std::string, InputScript> scripts;
+  for (Session &session : sessions) {
+    auto rom = roms.find(session.rom_file);
+    if (rom == roms.end()) {
+      rom = roms.emplace(session.rom_file,
+                         Rom::ReadRomFile(session.rom_file))
+                .first;
+    }
+    session.rom = &rom->second;
+
+    auto script = scripts.find(session.script_file);
+    if (script == scripts.end()) {
+      script = scripts.emplace(session.script_file, InputScript()).first;
+      if (!session.script_file.empty() &&
+          !read_script(session.script_file, script->second)) {
+        return 1;
+      }
+    }
+    session.script = &script->second;
+  }
+
+  std::vector<SessionResult> results(sessions.size());
+  jobs = std::min<size_t>(jobs, std::max<size_t>(1, sessions.size()));
+  auto start = std::chrono::steady_clock::now();
+  run_sessions(sessions, core, budget, output_dir, jobs, results);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::uint64_t frames = 0, instructions = 0;
+  for (size_t i = 0; i < sessions.size(); i++) {
+    const SessionResult &result = results[i];
+    frames += result.frames;
+    instructions += result.instructions;
+
+    std::printf("%zu %s frames=%llu instructions=%llu max_frame=%llu "
+                "overruns=%llu framebuffer=%016llx output=%016llx%s\n",
+                i, sessions[i].rom_file.c_str(),
+                static_cast<unsigned long long>(result.frames),
+                static_cast<unsigned long long>(result.instructions),
+                static_cast<unsigned long long>(
+                    result.budget.max_frame_instructions),
+                static_cast<unsigned long long>(result.budget.overruns),
+                static_cast<unsigned long long>(result.framebuffer_hash),
+                static_cast<unsigned long long>(result.output_hash),
+                result.stopped ? " stopped" : "");
+    if (!result.written) return 1;
+  }
+
+  std::cerr << sessions.size() << " sessions, " << frames << " frames in "
+            << elapsed.count() << " s on " << jobs << " threads ("
+            << frames / elapsed.count() << " frames/s, "
+            << instructions / elapsed.count() << " instructions/s)"
+            << std::endl;
+  return 0;
+}
@@ -0,0 +1,348 @@
+#include <unistd.h>
+
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "blit.h"
+#include "controller.h"
+#include "emulator.h"
+#include "lockstep.h"
+#include "memory.h"
+#include "rom.h"
+#include "types.h"
+
+/*
+ * Microbenchmarks for the emulator's hot paths. Numbers are only meaningful
+ * for an optimized build (-DCMAKE_BUILD_TYPE=Release).
+ */
+
+using BenchMemory = Memory<std::istream, std::ostream, std::ostream>;
+
+constexpr size_t ITERATIONS = 50'000'000;
+
+// keeps the optimizer from dropping the measured work
+static volatile std::uint32_t sink;
+
+template <typename F>
+static void bench(const char *name, size_t iterations, F f) {
+  auto start = std::chrono::steady_clock::now();
+  std::uint32_t sum = 0;
+  for (size_t i = 0; i < iterations; i++) sum += f(i);
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  sink = sum;
+
+  std::printf("%-32s %8.3f ns/op\n", name, elapsed.count() / iterations);
+}
+
+// stack and VRAM addresses, which is where most ROM loads and stores go
+static address_t ram_address(size_t i) {
+  return AddressSpace::StackStart +
+         (i * 2) % (AddressSpace::VramEnd - AddressSpace::StackStart);
+}
+
+static void bench_memory() {
+  std::istringstream in;
+  std::ostringstream out, err;
+  ControllerState cont;
+  BenchMemory mem(in, out, err, cont);
+
+  std::printf("memory:\n");
+  bench("read_byte (checked)", ITERATIONS,
+        [&](size_t i) { return mem.read_byte(ram_address(i)); });
+  bench("read_byte<Ram>", ITERATIONS, [&](size_t i) {
+    return mem.read_byte<AddressClass::Ram>(ram_address(i));
+  });
+  bench("read_word (checked)", ITERATIONS,
+        [&](size_t i) { return mem.read_word(ram_address(i)); });
+  bench("read_word<Ram>", ITERATIONS, [&](size_t i) {
+    return mem.read_word<AddressClass::Ram>(ram_address(i));
+  });
+  bench("write_word (checked)", ITERATIONS, [&](size_t i) {
+    mem.write_word(ram_address(i), i);
+    return 0;
+  });
+  bench("write_word<Ram>", ITERATIONS, [&](size_t i) {
+    mem.write_word<AddressClass::Ram>(ram_address(i), i);
+    return 0;
+  });
+}
+
+// what SDL_MapRGB does for a 32-bit format, kept out of line as SDL's is
+__attribute__((noinline)) static std::uint32_t map_rgb(const int *shifts,
+                                                       byte_t r, byte_t g,
+                                                       byte_t b) {
+  return (std::uint32_t{r} << shifts[0]) | (std::uint32_t{g} << shifts[1]) |
+         (std::uint32_t{b} << shifts[2]);
+}
+
+// turning a frame of VRAM into window pixels, the way Gpu::renderFrame did
+// (column by column, mapping each pixel) against the GrayscaleBlitter
+static void bench_render() {
+  constexpr size_t FRAMES = 20'000;
+  std::vector<byte_t> frame(WindowArea);
+  for (size_t i = 0; i < WindowArea; i++) frame[i] = i * 7;
+  std::vector<std::uint32_t> pixels(WindowArea);
+  const int shifts[3] = {16, 8, 0};
+
+  std::uint32_t rgb888[256], rgb565[256];
+  for (std::uint32_t gray = 0; gray < 256; gray++) {
+    rgb888[gray] = map_rgb(shifts, gray, gray, gray);
+    rgb565[gray] = (gray >> 3 << 11) | (gray >> 2 << 5) | (gray >> 3);
+  }
+  GrayscaleBlitter table(rgb565);
+  GrayscaleBlitter simd(rgb888);
+
+  std::printf("render:\n");
+  bench("column-major + map_rgb", FRAMES, [&](size_t i) {
+    for (size_t x = 0; x < WindowWidth; x++) {
+      for (size_t y = 0; y < WindowHeight; y++) {
+        byte_t pixel = frame[x + y * WindowWidth];
+        pixels[x + y * WindowWidth] = map_rgb(shifts, pixel, pixel, pixel);
+      }
+    }
+    return pixels[i % WindowArea];
+  });
+  bench("GrayscaleBlitter (table)", FRAMES, [&](size_t i) {
+    table.blit(frame.data(), pixels.data(), WindowWidth * 4);
+    return pixels[i % WindowArea];
+  });
+  bench(simd.vectorized() ? "GrayscaleBlitter (SSE2)"
+                          : "GrayscaleBlitter (no SIMD)",
+        FRAMES, [&](size_t i) {
+          simd.blit(frame.data(), pixels.data(), WindowWidth * 4);
+          return pixels[i % WindowArea];
+        });
+
+  // scaled up 4 times for the window surface, against looking up the
+  // frame's pixel for every window pixel
+  constexpr size_t SCALE = 4;
+  std::vector<std::uint32_t> scaled(WindowArea * SCALE * SCALE);
+  GrayscaleBlitter simd4(rgb888, SCALE);
+  bench("x4 nearest, per window pixel", FRAMES / 10, [&](size_t i) {
+    for (size_t y = 0; y < WindowHeight * SCALE; y++) {
+      for (size_t x = 0; x < WindowWidth * SCALE; x++) {
+        scaled[y * WindowWidth * SCALE + x] =
+            rgb888[frame[y / SCALE * WindowWidth + x / SCALE]];
+      }
+    }
+    return scaled[i % scaled.size()];
+  });
+  bench("GrayscaleBlitter x4", FRAMES / 10, [&](size_t i) {
+    simd4.blit(frame.data(), scaled.data(), WindowWidth * SCALE * 4);
+    return scaled[i % scaled.size()];
+  });
+}
+
+// gives every lane its own button sequence, so that lanes diverge
+static ControllerButton lane_input(size_t lane, int frame) {
+  return static_cast<ControllerButton>(1 << ((lane + frame / 16) % 8));
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// cost of driving the emulator one frame at a time through step_frames
+static void bench_step(const char *rom_file) {
+  Rom rom = Rom::ReadRomFile(rom_file);
+  std::istringstream in;
+  // drops whatever the ROM prints
+  std::ostream null(nullptr);
+  Emulator emu(in, null, null);
+  emu.set_interpreter_core(InterpreterCore::Threaded);
+  emu.reset(rom);
+
+  std::printf("step (%s):\n", rom_file);
+  bench("step_frames(1)", 200'000, [&](size_t i) {
+    ControllerState cont;
+    cont.push_button(lane_input(i, 0));
+    emu.step_frames(1, cont);
+    return emu.get_vram()[i % WindowArea];
+  });
+}
+
+// aggregate throughput of N lanes in lockstep against N separate Emulators
+static void bench_lockstep(const char *rom_file) {
+  constexpr int FRAMES = 60;
+  Rom rom = Rom::ReadRomFile(rom_file);
+
+  std::printf("lockstep (%s, avx2 %s):\n", rom_file,
+              LockstepEmulator::simd_supported() ? "on" : "off");
+  for (size_t lanes : {1, 16, 64, 256}) {
+    auto start = std::chrono::steady_clock::now();
+    LockstepEmulator lockstep(lanes);
+    lockstep.start_rom(rom);
+    for (int frame = 0; frame < FRAMES; frame++) {
+      for (size_t i = 0; i < lanes; i++) {
+        lockstep.get_controller(i) = ControllerState();
+        lockstep.get_controller(i).push_button(lane_input(i, frame));
+      }
+      lockstep.execute_frame();
+    }
+    double lockstep_rate =
+        lockstep.get_instruction_count() / seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    std::uint64_t instructions = 0;
+    for (size_t i = 0; i < lanes; i++) {
+      Emulator emu;
+      emu.set_interpreter_core(InterpreterCore::Threaded);
+      emu.start_rom(rom);
+      for (int frame = 0; frame < FRAMES; frame++) {
+        emu.get_controller() = ControllerState();
+        emu.get_controller().push_button(lane_input(i, frame));
+        emu.execute_frame();
+      }
+      instructions += emu.get_instruction_count();
+    }
+    double threaded_rate = instructions / seconds_since(start);
+
+    std::printf("%4zu lanes %10.3g instructions/s (threaded core: %.3g)\n",
+                lanes, lockstep_rate, threaded_rate);
+  }
+}
+
+// resident memory, where /proc says
+static double rss_kib() {
+  std::ifstream statm("/proc/self/statm");
+  long size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * (sysconf(_SC_PAGESIZE) / 1024.0);
+}
+
+// makes many forks of one running ROM, then runs them all on every core
+static void bench_fork(const char *rom_file) {
+  constexpr size_t FORKS = 1000;
+  constexpr int FRAMES = 10;
+  Rom rom = Rom::ReadRomFile(rom_file);
+  std::istringstream in;
+  std::ostream null(nullptr);
+  Emulator parent(in, null, null);
+  parent.set_interpreter_core(InterpreterCore::Threaded);
+  parent.reset(rom);
+  parent.step_frames(30, ControllerState());
+
+  std::printf("fork (%s):\n", rom_file);
+  double rss = rss_kib();
+  std::vector<std::unique_ptr<Emulator>> forks;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < FORKS; i++) {
+    forks.push_back(parent.fork(in, null, null));
+  }
+  double elapsed = seconds_since(start);
+  std::printf("%zu forks %10.3f us/fork %8.1f KiB/fork\n", FORKS,
+              elapsed * 1e6 / FORKS, (rss_kib() - rss) / FORKS);
+
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  std::atomic<size_t> next(0);
+  start = std::chrono::steady_clock::now();
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < FORKS;) {
+      ControllerState cont;
+      cont.push_button(lane_input(i, 0));
+      forks[i]->step_frames(FRAMES, cont);
+    }
+  };
+  std::vector<std::thread> pool;
+  for (unsigned t = 0; t < threads; t++) pool.emplace_back(worker);
+  for (std::thread &thread : pool) thread.join();
+  elapsed = seconds_since(start);
+  std::printf("%zu forks x %d frames on %u threads %10.3g frames/s, "
+              "%8.1f KiB/fork after\n",
+              FORKS, FRAMES, threads, FORKS * FRAMES / elapsed,
+              (rss_kib() - rss) / FORKS);
+}
+
+// the extra cost of showing each frame some frames ahead
+static void bench_run_ahead(const char *rom_file) {
+  constexpr int FRAMES = 600;
+  Rom rom = Rom::ReadRomFile(rom_file);
+  std::printf("run-ahead (%s):\n", rom_file);
+  for (std::uint64_t ahead : {0, 1, 2, 4}) {
+    Emulator emu;
+    emu.set_interpreter_core(InterpreterCore::Threaded);
+    emu.reset(rom);
+    auto start = std::chrono::steady_clock::now();
+    for (int f = 0; f < FRAMES && !emu.is_halted(); f++) {
+      ControllerState cont;
+      cont.push_button(lane_input(0, f));
+      emu.step_frames(1, cont);
+      sink = emu.run_ahead(ahead)[0];
+    }
+    std::printf("%llu frames ahead %10.3f us/frame\n",
+                static_cast<unsigned long long>(ahead),
+                seconds_since(start) * 1e6 / FRAMES);
+  }
+}
+
+// what a window redrawing only changed rows converts each frame: the rows
+// the ROM wrote, and of those the rows that differ from the last frame
+static void bench_changed_rows(const char *rom_file) {
+  constexpr int FRAMES = 600;
+  Rom rom = Rom::ReadRomFile(rom_file);
+  Emulator emu;
+  emu.set_interpreter_core(InterpreterCore::Threaded);
+  emu.reset(rom);
+
+  std::uint32_t rgb888[256];
+  for (std::uint32_t gray = 0; gray < 256; gray++) {
+    rgb888[gray] = gray * 0x010101;
+  }
+  GrayscaleBlitter blitter(rgb888);
+  std::vector<byte_t> shown(WindowArea);
+  std::vector<std::uint32_t> pixels(WindowArea);
+  size_t written = 0, changed = 0;
+  double full = 0, partial = 0;
+  for (int f = 0; f < FRAMES && !emu.is_halted(); f++) {
+    ControllerState cont;
+    cont.push_button(lane_input(0, f));
+    emu.step_frames(1, cont);
+
+    auto start = std::chrono::steady_clock::now();
+    blitter.blit(emu.get_vram(), pixels.data(), WindowWidth * 4);
+    full += seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    std::bitset<WindowHeight> rows = emu.take_changed_rows();
+    written += rows.count();
+    keep_changed_rows(emu.get_vram(), shown.data(), rows);
+    changed += rows.count();
+    for (size_t y = 0; y < WindowHeight; y++) {
+      if (rows[y]) {
+        blitter.blit(emu.get_vram(), &pixels[y * WindowWidth], WindowWidth * 4,
+                     y, y + 1);
+      }
+    }
+    partial += seconds_since(start);
+  }
+  std::printf("changed rows (%s):\n", rom_file);
+  std::printf("rows written %6.1f/frame, changed %6.1f/frame\n",
+              static_cast<double>(written) / FRAMES,
+              static_cast<double>(changed) / FRAMES);
+  std::printf("whole frame %10.3f us/frame, changed rows %10.3f us/frame\n",
+              full * 1e6 / FRAMES, partial * 1e6 / FRAMES);
+}
+
+int main(int argc, char **argv) {
+  bench_memory();
+  bench_render();
+  // e.g. rom-archive/games/snake.slug
+  if (argc > 1) {
+    bench_step(argv[1]);
+    bench_lockstep(argv[1]);
+    bench_fork(argv[1]);
+    bench_run_ahead(argv[1]);
+    bench_changed_rows(argv[1]);
+  }
+  return 0;
+}
@@ -0,0 +1,147 @@
+#include "blit.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+GrayscaleBlitter::GrayscaleBlitter(const std::uint32_t *table, int scale)
+    : replicates_(true),
+      channel_mask_(table[255] ^ table[0]),
+      fixed_bits_(table[0]),
+      scale_(std::clamp(scale, 1, MAX_BLIT_SCALE)) {
+  std::memcpy(table_, table, sizeof(table_));
+  for (std::uint32_t gray = 0; gray < 256; gray++) {
+    replicates_ &= table[gray] == (fixed_bits_ | (gray * 0x01010101 &
+                                                  channel_mask_));
+  }
+}
+
+bool GrayscaleBlitter::vectorized() const {
+#if defined(__SSE2__)
+  return replicates_;
+#else
+  return false;
+#endif
+}
+
+void keep_changed_rows(const byte_t *frame, byte_t *shown,
+                       std::bitset<WindowHeight> &rows) {
+  for (size_t y = 0; y < WindowHeight; y++) {
+    if (!rows[y]) continue;
+    const byte_t *row = frame + y * WindowWidth;
+    byte_t *shown_row = shown + y * WindowWidth;
+    if (std::memcmp(row, shown_row, WindowWidth) == 0) {
+      rows.reset(y);
+    } else {
+      std::memcpy(shown_row, row, WindowWidth);
+    }
+  }
+}
+
+#if defined(__SSE2__)
+static_assert(WindowWidth % 16 == 0, "rows are widened 16 pixels at a time");
+
+static void blit_row_sse2(const byte_t *row, std::uint32_t *out,
+                          std::uint32_t channel_mask,
+                          std::uint32_t fixed_bits) {
+  const __m128i mask = _mm_set1_epi32(static_cast<int>(channel_mask));
+  const __m128i fixed = _mm_set1_epi32(static_cast<int>(fixed_bits));
+  for (size_t x = 0; x < WindowWidth; x += 16) {
+    __m128i gray = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x));
+    // each byte doubled, then doubled again, fills a 32-bit lane with it
+    __m128i low = _mm_unpacklo_epi8(gray, gray);
+    __m128i high = _mm_unpackhi_epi8(gray, gray);
+    __m128i pixels[4] = {
+        _mm_unpacklo_epi16(low, low), _mm_unpackhi_epi16(low, low),
+        _mm_unpacklo_epi16(high, high), _mm_unpackhi_epi16(high, high)};
+    for (int i = 0; i < 4; i++) {
+      __m128i pixel = _mm_or_si128(_mm_and_si128(pixels[i], mask), fixed);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x + i * 4), pixel);
+    }
+  }
+}
+
+static void store(std::uint32_t *out, __m128i pixels) {
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out), pixels);
+}
+
+// repeats each of the row's pixels `scale` times, 4 pixels at a time.
+// returns false, having written nothing, for scales other than 2, 3 and 4
+static bool widen_row_sse2(const std::uint32_t *row, std::uint32_t *out,
+                           int scale) {
+  for (size_t x = 0; x < WindowWidth; x += 4, out += 4 * scale) {
+    // a b c d
+    __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x));
+    switch (scale) {
+      case 2:
+        store(out, _mm_unpacklo_epi32(p, p));
+        store(out + 4, _mm_unpackhi_epi32(p, p));
+        break;
+      case 3:
+        store(out, _mm_shuffle_epi32(p, _MM_SHUFFLE(1, 0, 0, 0)));
+        store(out + 4, _mm_shuffle_epi32(p, _MM_SHUFFLE(2, 2, 1, 1)));
+        store(out + 8, _mm_shuffle_epi32(p, _MM_SHUFFLE(3, 3, 3, 2)));
+        break;
+      case 4: {
+        __m128i ab = _mm_unpacklo_epi32(p, p);
+        __m128i cd = _mm_unpackhi_epi32(p, p);
+        store(out, _mm_unpacklo_epi64(ab, ab));
+        store(out + 4, _mm_unpackhi_epi64(ab, ab));
+        store(out + 8, _mm_unpacklo_epi64(cd, cd));
+        store(out + 12, _mm_unpackhi_epi64(cd, cd));
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+#endif
+
+void GrayscaleBlitter::convert_row(const byte_t *row,
+                                   std::uint32_t *out) const {
+#if defined(__SSE2__)
+  if (replicates_) {
+    blit_row_sse2(row, out, channel_mask_, fixed_bits_);
+    return;
+  }
+#endif
+  for (size_t x = 0; x < WindowWidth; x++) out[x] = table_[row[x]];
+}
+
+void GrayscaleBlitter::blit(const byte_t *frame, void *pixels, size_t pitch,
+                            size_t first_row, size_t last_row) const {
+  auto *row_start = static_cast<byte_t *>(pixels);
+  std::uint32_t line[WindowWidth];
+  for (size_t y = first_row; y < last_row; y++) {
+    const byte_t *row = frame + y * WindowWidth;
+    auto *out = reinterpret_cast<std::uint32_t *>(row_start);
+    if (scale_ == 1) {
+      convert_row(row, out);
+      row_start += pitch;
+      continue;
+    }
+
+    convert_row(row, line);
+#if defined(__SSE2__)
+    bool widened = widen_row_sse2(line, out, scale_);
+#else
+    bool widened = false;
+#endif
+    if (!widened) {
+      for (size_t x = 0; x < WindowWidth; x++) {
+        std::fill_n(out + x * scale_, scale_, line[x]);
+      }
+    }
+    // the row's other copies
+    for (int copy = 1; copy < scale_; copy++) {
+      std::memcpy(row_start + copy * pitch, out,
+                  WindowWidth * scale_ * sizeof(std::uint32_t));
+    }
+    row_start += scale_ * pitch;
+  }
+}
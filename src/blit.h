@@ -0,0 +1,47 @@
+#pragma once
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+
+#include "memory.h"
+#include "types.h"
+
+// largest factor GrayscaleBlitter scales by
+constexpr int MAX_BLIT_SCALE = 8;
+
+/*
+ * Turns grayscale frames into 32-bit pixels a row at a time, optionally
+ * scaled up by a whole factor (nearest neighbour). Each gray level's pixel
+ * comes from a table filled in once for the target format. When the format
+ * just repeats the gray level across byte-wide channels, SSE2 widens 16
+ * pixels at a time instead; scaling by 2, 3 or 4 uses SSE2 as well.
+ */
+class GrayscaleBlitter {
+ private:
+  std::uint32_t table_[256];
+  // set if every pixel is fixed_bits_ | (gray * 0x01010101 & channel_mask_)
+  bool replicates_;
+  std::uint32_t channel_mask_;
+  std::uint32_t fixed_bits_;
+  int scale_;
+
+  void convert_row(const byte_t *row, std::uint32_t *out) const;
+
+ public:
+  // table holds the pixel for each gray level. scale is 1 to MAX_BLIT_SCALE
+  explicit GrayscaleBlitter(const std::uint32_t *table, int scale = 1);
+
+  // converts rows [first_row, last_row) of a WindowWidth x WindowHeight frame
+  // to pixels, where the first of them goes. each frame row becomes scale
+  // rows of WindowWidth * scale pixels, which start pitch bytes apart
+  void blit(const byte_t *frame, void *pixels, size_t pitch,
+            size_t first_row = 0, size_t last_row = WindowHeight) const;
+  // whether blit() uses SIMD for this table
+  bool vectorized() const;
+};
+
+// unmarks the rows that are the same in frame and shown, and copies the
+// others from frame to shown. both are WindowWidth x WindowHeight frames
+void keep_changed_rows(const byte_t *frame, byte_t *shown,
+                       std::bitset<WindowHeight> &rows);
@@ -1,321 +1,835 @@
 #include "emulator.h"
 
-#include <SDL2/SDL.h>
-
-#include <chrono>
+#include <algorithm>
 #include <cstdint>
-#include <fstream>
+#include <cstring>
 #include <iostream>
+#include <sstream>
 
 #include "controller.h"
-#include "gpu.h"
 #include "instruction_data.h"
 #include "rom.h"
+#include "savestate.h"
+
+Emulator::Emulator() : Emulator(std::cin, std::cout, std::cerr) {}
+
+Emulator::Emulator(std::istream &in, std::ostream &out, std::ostream &err)
+    : register_file_{},
+      memory_(in, out, err, cont_),
+      core_(InterpreterCore::Switch),
+      instruction_count_(0),
+      frame_count_(0),
+      loop_address_(0),
+      base_hash_(0),
+      rewind_interval_(1),
+      run_ahead_checkpoint_(DirtyTracker::RunAhead),
+      running_ahead_(false),
+      idle_poll_address_(0),
+      idle_poll_count_(0),
+      idle_poll_registers_{},
+      idle_resume_(0),
+      idle_frame_count_(0),
+      budget_stats_{},
+      instruction_limit_(UINT64_MAX),
+      budget_checkpoint_(DirtyTracker::Budget) {}
+
+void Emulator::start_rom(const Rom &rom) {
+  memory_.mount_rom(rom);
+  jit_.flush();
+  idle_loops_ = std::make_shared<const IdleLoops>(memory_.get_decoded_rom());
+  if (recompiled_ != nullptr && recompiled_->rom_hash() != rom.hash()) {
+    recompiled_.reset();
+  }
+  // initialize stack pointer
+  register_file_[29] = 0x3400;
 
-using namespace std::chrono_literals;
-#define FRAME_PERIOD 16.67ms
+  register_file_[31] = 0x00;
+  program_counter_ = rom.slug_setup_;
+  loop_address_ = rom.slug_loop_;
+  frame_count_ = 0;
+  set_base_state();
+
+  // setup function
+  std::uint64_t start = instruction_count_;
+  bool finished = execute_until_return(budget_.setup);
+  budget_stats_.setup_instructions = instruction_count_ - start;
+  if (!finished) overrun(true);
+  restart_rewind();
+}
+
+// a frame cut short by a halt, or by an overrun while running ahead, isn't
+// counted
+bool Emulator::run_frame() {
+  if (memory_.halted()) return false;
+
+  if (budget_.frame != 0 && budget_.policy == OverrunPolicy::Drop) {
+    budget_checkpoint_.save(register_file_, program_counter_, memory_);
+  }
+  // a frame that ended early is picked up where it left off
+  if (program_counter_ == 0) program_counter_ = loop_address_;
+  std::uint64_t start = instruction_count_;
+  bool finished = execute_until_return(budget_.frame);
+  budget_stats_.last_frame_instructions = instruction_count_ - start;
+  budget_stats_.max_frame_instructions =
+      std::max(budget_stats_.max_frame_instructions,
+               budget_stats_.last_frame_instructions);
+  if (!finished) {
+    // a frame run ahead is thrown away anyway; the real one reports it
+    if (running_ahead_) return false;
+    overrun(false);
+  }
+  if (memory_.halted()) return false;
+
+  frame_count_++;
+  return true;
+}
+
+void Emulator::overrun(bool setup) {
+  budget_stats_.overruns++;
+  budget_stats_.last_overrun_pc = program_counter_;
+
+  OverrunPolicy policy = budget_.policy;
+  if (setup && policy == OverrunPolicy::Drop) policy = OverrunPolicy::Abort;
+  switch (policy) {
+    case OverrunPolicy::Abort: {
+      // one write, so that emulators on other threads don't cut into it
+      std::ostringstream dump;
+      dump << "Error: ";
+      if (setup) {
+        dump << "setup ran past its budget of " << budget_.setup;
+      } else {
+        dump << "frame " << frame_count_ << " ran past its budget of "
+             << budget_.frame;
+      }
+      dump << " instructions at PC 0x" << std::hex << program_counter_
+           << "; halting.\n";
+      for (int r = 0; r < NUM_REGISTERS; r++) {
+        dump << "  r" << std::dec << r << "=0x" << std::hex
+             << register_file_[r] << ((r + 1) % 8 == 0 ? "\n" : "");
+      }
+      std::cerr << dump.str() << std::flush;
+      memory_.halt();
+      break;
+    }
+    case OverrunPolicy::Carry:
+      break;
+    case OverrunPolicy::Drop:
+      budget_checkpoint_.restore(register_file_, program_counter_, memory_);
+      break;
+  }
+}
 
-Register::Register() : is_zero_(false), value_(0) {}
-Register::Register(bool is_zero) : is_zero_(is_zero), value_(0) {}
-Register::Register(register_value_t value) : is_zero_(false), value_(value) {}
+void Emulator::execute_frame() {
+  if (!run_frame()) return;
 
-Register &Register::operator=(register_value_t value) {
-  if (!is_zero_) {
-    this->value_ = value;
+  if (rewind_ != nullptr && frame_count_ % rewind_interval_ == 0) {
+    rewind_->capture(frame_count_, register_file_, program_counter_, memory_);
   }
+}
+
+void Emulator::reset(const Rom &rom) {
+  std::fill(std::begin(register_file_), std::end(register_file_), 0);
+  memory_.clear_ram();
+  cont_ = ControllerState();
+  instruction_count_ = 0;
+  idle_frame_count_ = 0;
+  budget_stats_ = BudgetStats{};
 
-  return *this;
+  start_rom(rom);
 }
 
-register_value_t Register::operator*() const {
-  if (is_zero_) return 0;
-  return value_;
+std::uint64_t Emulator::step_frames(std::uint64_t n,
+                                    const ControllerState &controller) {
+  cont_ = controller;
+
+  std::uint64_t start = frame_count_;
+  while (!memory_.halted() && frame_count_ - start < n) execute_frame();
+  return frame_count_ - start;
 }
 
-void stop_emulator() { throw StopException(); }
+bool Emulator::is_halted() const { return memory_.halted(); }
 
-Emulator::Emulator()
-    : memory_(std::cin, std::cout, std::cerr, cont_, stop_emulator),
-      gpu(memory_) {
-  register_file_[0] = Register(true);
+void Emulator::execute_rom(const Rom &rom, std::uint64_t max_frames) {
+  start_rom(rom);
+  while (!memory_.halted() && (max_frames == 0 || frame_count_ < max_frames)) {
+    execute_frame();
+  }
+}
+
+// loads and stores of the interpreter cores: RAM skips the page table
+inline byte_t Emulator::load_byte(address_t a) {
+  if (is_ram_address(a)) return memory_.read_byte<AddressClass::Ram>(a);
+  return memory_.read_byte(a);
+}
+
+inline word_t Emulator::load_word(address_t a) {
+  if (is_ram_address(a)) return memory_.read_word<AddressClass::Ram>(a);
+  return memory_.read_word(a);
+}
 
-  for (int i = 1; i < 32; i++) {
-    register_file_[i] = Register(false);
+// returns false when the store halted the ROM (only byte stores can)
+inline bool Emulator::store_byte(address_t a, byte_t byte) {
+  if (is_ram_address(a)) {
+    memory_.write_byte<AddressClass::Ram>(a, byte);
+    return true;
   }
+  memory_.write_byte(a, byte);
+  return !memory_.halted();
 }
 
-void Emulator::handle_event(SDL_Event const &evt) {
-  switch (evt.type) {
-    case SDL_WINDOWEVENT:
-      if (evt.window.event == SDL_WINDOWEVENT_CLOSE) {
-        warn("closing window due to quit");
-        throw StopException();
-      }
+inline void Emulator::store_word(address_t a, word_t word) {
+  if (is_ram_address(a)) {
+    memory_.write_word<AddressClass::Ram>(a, word);
+  } else {
+    memory_.write_word(a, word);
+  }
+}
+
+/*
+ * runs from the current PC until the function returns to address 0, until
+ * it spins in an idle loop, or until it has run `budget` instructions (0 for
+ * no limit). the PC is left where it stopped; returns false if that was
+ * because of the budget.
+ */
+bool Emulator::execute_until_return(std::uint64_t budget) {
+  idle_poll_address_ = 0;
+  instruction_limit_ = budget == 0 ? UINT64_MAX : instruction_count_ + budget;
+  switch (core_) {
+    case InterpreterCore::Switch:
+      execute_until_return_switch();
       break;
-    case SDL_KEYDOWN:
-      switch (evt.key.keysym.sym) {
-        case SDLK_RETURN:
-          cont_.push_button(START);
-          break;
-        case SDLK_SPACE:
-          cont_.push_button(SELECT);
-          break;
-        case SDLK_UP:
-          cont_.push_button(UP);
-          break;
-        case SDLK_DOWN:
-          cont_.push_button(DOWN);
-          break;
-        case SDLK_LEFT:
-          cont_.push_button(LEFT);
-          break;
-        case SDLK_RIGHT:
-          cont_.push_button(RIGHT);
-          break;
-        case SDLK_z:
-          cont_.push_button(B);
-          break;
-        case SDLK_x:
-          cont_.push_button(A);
-          break;
-      }
+    case InterpreterCore::Threaded:
+      execute_until_return_threaded();
       break;
-    case SDL_KEYUP:
-      switch (evt.key.keysym.sym) {
-        case SDLK_RETURN:
-          cont_.unpush_button(START);
-          break;
-        case SDLK_SPACE:
-          cont_.unpush_button(SELECT);
-          break;
-        case SDLK_UP:
-          cont_.unpush_button(UP);
-          break;
-        case SDLK_DOWN:
-          cont_.unpush_button(DOWN);
-          break;
-        case SDLK_LEFT:
-          cont_.unpush_button(LEFT);
-          break;
-        case SDLK_RIGHT:
-          cont_.unpush_button(RIGHT);
-          break;
-        case SDLK_z:
-          cont_.unpush_button(B);
-          break;
-        case SDLK_x:
-          cont_.unpush_button(A);
-          break;
-      }
+    case InterpreterCore::Jit:
+      execute_until_return_jit();
+      break;
+    case InterpreterCore::Aot:
+      execute_until_return_aot();
       break;
   }
+
+  if (idle_resume_ != 0) {
+    program_counter_ = idle_resume_;
+    idle_resume_ = 0;
+    idle_frame_count_++;
+    return true;
+  }
+  return program_counter_ == 0;
 }
 
-void Emulator::execute_rom(const Rom &rom) {
-  memory_.mount_rom(rom);
-  // initialize stack pointer
-  register_file_[29] = 0x3400;
+/*
+ * called before the controller load at the PC. the cores return as if from
+ * the function when this is true, which it is when the load polls an idle
+ * loop that went once round since the last poll without changing the
+ * registers: from there on, every trip round would be the same.
+ */
+bool Emulator::idle_poll() {
+  std::uint8_t length =
+      idle_loops_ == nullptr ? 0 : idle_loops_->loop_length(program_counter_);
+  if (length == 0) return false;
+
+  if (idle_poll_address_ == program_counter_ &&
+      instruction_count_ - idle_poll_count_ == length &&
+      std::equal(register_file_, register_file_ + NUM_REGISTERS,
+                 idle_poll_registers_)) {
+    idle_resume_ = program_counter_;
+    program_counter_ = 0;
+    // the load runs next frame
+    instruction_count_--;
+    return true;
+  }
+  idle_poll_address_ = program_counter_;
+  idle_poll_count_ = instruction_count_;
+  std::copy_n(register_file_, NUM_REGISTERS, idle_poll_registers_);
+  return false;
+}
 
-  register_file_[31] = 0x00;
-  program_counter_ = rom.slug_setup_;
+void Emulator::execute_until_return_switch() {
+  while (program_counter_ != 0 && instruction_count_ < instruction_limit_) {
+    instruction_count_++;
+    execute_decoded(memory_.read_decoded_instruction(program_counter_));
+  }
+}
 
-  // setup function
-  while (program_counter_ != 0) {
-    Instruction i{memory_.read_instruction(program_counter_)};
-    // std::cerr << "s: " << i << std::endl;
-    if (i.is_i_type()) {
-      execute_I_Instruction(i.decode_i_type());
-    } else if (i.is_r_type()) {
-      execute_R_Instruction(i.decode_r_type());
+/*
+ * same semantics as execute_decoded, but every handler dispatches the next
+ * instruction itself, so there is one indirect jump per instruction and no
+ * shared switch. needs the GCC/Clang labels-as-values extension; other
+ * compilers fall back to the switch core.
+ */
+void Emulator::execute_until_return_threaded() {
+#if defined(__GNUC__)
+  // indexed by Operation
+  static const void *const handlers[] = {
+      &&ori, &&addi, &&beq, &&bne, &&sb,  &&lbu, &&jal, &&lw,  &&sw,  &&j,
+      &&nor, &&slt,  &&sll, &&sra, &&jr,  &&srl, &&or_, &&sub, &&add, &&and_,
+      &&invalid,
+  };
+  static_assert(sizeof(handlers) / sizeof(handlers[0]) ==
+                    static_cast<size_t>(Operation::INVALID) + 1,
+                "every Operation needs a handler");
+
+  DecodedInstruction d;
+  register_value_t a, b;
+
+#define DISPATCH()                                          \
+  do {                                                      \
+    if (program_counter_ == 0) return;                      \
+    d = memory_.read_decoded_instruction(program_counter_); \
+    instruction_count_++;                                   \
+    register_file_[0] = 0;                                  \
+    a = register_file_[d.reg_a];                            \
+    b = register_file_[d.reg_b];                            \
+    goto *handlers[static_cast<uint8_t>(d.operation)];      \
+  } while (0)
+#define NEXT()              \
+  do {                      \
+    program_counter_ += 4;  \
+    DISPATCH();             \
+  } while (0)
+  // every loop takes a jump or branch, so the budget is checked only there
+#define JUMP()                                              \
+  do {                                                      \
+    if (instruction_count_ >= instruction_limit_) return;   \
+    DISPATCH();                                             \
+  } while (0)
+
+  DISPATCH();
+
+ori:
+  register_file_[d.reg_b] = a | d.immediate;
+  NEXT();
+addi:
+  register_file_[d.reg_b] = a + d.immediate;
+  NEXT();
+beq:
+  if (a != b) NEXT();
+  program_counter_ += d.immediate * 4 + 4;
+  JUMP();
+bne:
+  if (a == b) NEXT();
+  program_counter_ += d.immediate * 4 + 4;
+  JUMP();
+sb:
+  if (!store_byte(a + d.immediate, b & 0xFF)) {
+    program_counter_ = 0;
+    return;
+  }
+  NEXT();
+lbu:
+  if (static_cast<address_t>(a + d.immediate) == AddressSpace::ControllerIo &&
+      idle_poll()) {
+    return;
+  }
+  register_file_[d.reg_b] = load_byte(a + d.immediate);
+  NEXT();
+jal:
+  register_file_[31] = program_counter_ + 4;
+  program_counter_ = d.immediate * 4;
+  JUMP();
+lw:
+  register_file_[d.reg_b] = load_word(a + d.immediate);
+  NEXT();
+sw:
+  store_word(a + d.immediate, b);
+  NEXT();
+j:
+  program_counter_ = d.immediate * 4;
+  JUMP();
+nor:
+  register_file_[d.reg_c] = ~(a | b);
+  NEXT();
+slt:
+  // ISA expects these to be signed values
+  register_file_[d.reg_c] = static_cast<int16_t>(a) < static_cast<int16_t>(b);
+  NEXT();
+sll:
+  register_file_[d.reg_c] = (b << d.shift_value);
+  NEXT();
+sra:
+  register_file_[d.reg_c] = static_cast<int16_t>(b) >> d.shift_value;
+  NEXT();
+jr:
+  program_counter_ = a;
+  JUMP();
+srl:
+  register_file_[d.reg_c] = b >> d.shift_value;
+  NEXT();
+or_:
+  register_file_[d.reg_c] = a | b;
+  NEXT();
+sub:
+  register_file_[d.reg_c] = a - b;
+  NEXT();
+add:
+  register_file_[d.reg_c] = a + b;
+  NEXT();
+and_:
+  register_file_[d.reg_c] = a & b;
+  NEXT();
+invalid:
+  warn("Invalid instruction!");
+  NEXT();
+
+#undef JUMP
+#undef NEXT
+#undef DISPATCH
+#else
+  execute_until_return_switch();
+#endif
+}
+
+/*
+ * shared driver for the JIT and AOT cores. run_native runs native code from
+ * state.program_counter and returns false when the instruction there has to
+ * be interpreted instead (MMIO and ROM accesses, invalid opcodes, code the
+ * native side doesn't know). those go through execute_decoded with the
+ * register file synced; a store that halts the ROM sets the PC to 0 there,
+ * which ends the loop like a return.
+ */
+template <typename State, typename Native>
+void Emulator::execute_until_return_native(Native run_native) {
+  State state;
+  state.memory = memory_.get_memory_buffer();
+  state.dirty_pages = memory_.get_dirty_pages();
+
+  auto sync_in = [&]() {
+    std::copy_n(register_file_, NUM_REGISTERS, state.registers);
+    state.program_counter = program_counter_;
+    state.instruction_count = 0;
+    state.instruction_limit = instruction_limit_ - std::min(instruction_count_,
+                                                            instruction_limit_);
+  };
+  auto sync_out = [&]() {
+    std::copy_n(state.registers, NUM_REGISTERS, register_file_);
+    program_counter_ = state.program_counter;
+    instruction_count_ += state.instruction_count;
+  };
+
+  // JIT blocks never loop, so checking between them is enough; recompiled
+  // code checks on its own jumps back
+  auto over_budget = [&]() {
+    return state.instruction_count >= state.instruction_limit;
+  };
+  sync_in();
+  while (state.program_counter != 0 && !over_budget()) {
+    if (run_native(state) || state.program_counter == 0 || over_budget()) {
+      continue;
     }
-    // std::cerr << "PC: " << program_counter_ << std::endl;
+
+    sync_out();
+    instruction_count_++;
+    execute_decoded(memory_.read_decoded_instruction(program_counter_));
+    sync_in();
   }
 
-  std::chrono::steady_clock timer;
+  sync_out();
+}
 
-  // loop function
-  for (;;) {
-    program_counter_ = rom.slug_loop_;
-    SDL_Event evt;
-    while (SDL_PollEvent(&evt)) {
-      handle_event(evt);
-    }
-    auto start = timer.now();
-    while (program_counter_ != 0) {
-      Instruction i{memory_.read_instruction(program_counter_)};
-      // std::cerr << "l: " << i << std::endl;
-      if (i.is_i_type()) {
-        execute_I_Instruction(i.decode_i_type());
-      } else if (i.is_r_type()) {
-        execute_R_Instruction(i.decode_r_type());
-      }
-    }
+// runs compiled blocks while control stays in the ROM
+void Emulator::execute_until_return_jit() {
+  if (!Jit::supported()) {
+    execute_until_return_threaded();
+    return;
+  }
 
-    auto end = timer.now();
-    while (end - start < FRAME_PERIOD) {
-      int millis = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       FRAME_PERIOD - (end - start))
-                       .count();
-      bool is_event = SDL_WaitEventTimeout(&evt, millis);
-      if (is_event) handle_event(evt);
-      end = timer.now();
+  execute_until_return_native<JitState>([this](JitState &state) {
+    if (state.program_counter < AddressSpace::RomStart ||
+        state.program_counter % sizeof(instruction_t) != 0) {
+      return false;
     }
 
-    gpu.renderFrame();
+    jit_block_t block =
+        jit_.block_at(memory_.get_decoded_rom(), state.program_counter);
+    return block != nullptr && block(&state) == JitExit::Continue;
+  });
+}
+
+// the recompiled ROM returns whenever it needs the interpreter
+void Emulator::execute_until_return_aot() {
+  if (recompiled_ == nullptr) {
+    execute_until_return_threaded();
+    return;
   }
+
+  execute_until_return_native<AotState>([this](AotState &state) {
+    recompiled_->run(&state);
+    return false;
+  });
 }
 
 void Emulator::execute_I_Instruction(const ITypeInstruction &i) {
-  register_value_t a = *register_file_[(int)i.reg_a];
-  register_value_t b = *register_file_[(int)i.reg_b];
-  immediate_t immediate = i.immediate;
+  execute_decoded(predecode(i));
+}
 
-  switch (static_cast<Opcode>(i.opcode)) {
-    case Opcode::ORI:
-      register_file_[i.reg_b] = a | immediate;
+void Emulator::execute_R_Instruction(const RTypeInstruction &r) {
+  if (r.opcode != static_cast<uint8_t>(Opcode::RTYPE)) {
+    warn("Non R type instruction!");
+    return;
+  }
+
+  execute_decoded(predecode(r));
+}
+
+void Emulator::execute_decoded(const DecodedInstruction &d) {
+  register_value_t a = register_file_[d.reg_a];
+  register_value_t b = register_file_[d.reg_b];
+  immediate_t immediate = d.immediate;
+
+  switch (d.operation) {
+    case Operation::ORI:
+      register_file_[d.reg_b] = a | immediate;
       break;
-    case Opcode::ADDI:
-      register_file_[i.reg_b] = a + immediate;
+    case Operation::ADDI:
+      register_file_[d.reg_b] = a + immediate;
       break;
-    case Opcode::BEQ:
+    case Operation::BEQ:
       if (a == b) {
         program_counter_ += immediate * 4;
       }
       break;
-    case Opcode::BNE:
+    case Operation::BNE:
       if (a != b) {
         program_counter_ += immediate * 4;
       }
       break;
-    case Opcode::SB:
-      memory_.write_byte(a + immediate, b & 0xFF);
+    case Operation::SB:
+      // a halt returns straight to whoever is running the ROM
+      if (!store_byte(a + immediate, b & 0xFF)) {
+        program_counter_ = 0;
+        return;
+      }
       break;
-    case Opcode::LBU:
-      register_file_[i.reg_b] = memory_.read_byte(a + immediate);
+    case Operation::LBU:
+      if (static_cast<address_t>(a + immediate) == AddressSpace::ControllerIo &&
+          idle_poll()) {
+        return;
+      }
+      register_file_[d.reg_b] = load_byte(a + immediate);
       break;
-    case Opcode::JAL:
+    case Operation::JAL:
       register_file_[31] = program_counter_ + 4;
       program_counter_ = immediate * 4;
+      return;
+    case Operation::LW:
+      register_file_[d.reg_b] = load_word(a + immediate);
       break;
-    case Opcode::LW:
-      register_file_[i.reg_b] = memory_.read_word(a + immediate);
-      break;
-    case Opcode::SW:
-      memory_.write_word(a + immediate, b);
+    case Operation::SW:
+      store_word(a + immediate, b);
       break;
-    case Opcode::J:
+    case Operation::J:
       program_counter_ = immediate * 4;
+      return;
+    case Operation::NOR:
+      register_file_[d.reg_c] = ~(a | b);
       break;
-    default:
-      warn("Non I-Type instruction!");
-      break;
-  }
-
-  // Increment PC if it's not a jump instruction
-  if (i.opcode != static_cast<uint8_t>(Opcode::JAL) &&
-      i.opcode != static_cast<uint8_t>(Opcode::J)) {
-    program_counter_ += 4;
-  }
-}
-
-void Emulator::execute_R_Instruction(const RTypeInstruction &r) {
-  if (r.opcode != static_cast<uint8_t>(Opcode::RTYPE)) {
-    warn("Non R type instruction!");
-    return;
-  }
-
-  register_value_t a = *register_file_[(int)r.reg_a];
-  register_value_t b = *register_file_[(int)r.reg_b];
-
-  switch (static_cast<FunctionCode>(r.function)) {
-    case FunctionCode::NOR:
-      register_file_[r.reg_c] = ~(a | b);
-      break;
-    case FunctionCode::SLT:
+    case Operation::SLT:
       // ISA expects these to be signed values
-      register_file_[r.reg_c] = *reinterpret_cast<const int16_t *>(&a) <
+      register_file_[d.reg_c] = *reinterpret_cast<const int16_t *>(&a) <
                                 *reinterpret_cast<const int16_t *>(&b);
       break;
-    case FunctionCode::SLL:
-      register_file_[r.reg_c] = (b << r.shift_value);
+    case Operation::SLL:
+      register_file_[d.reg_c] = (b << d.shift_value);
       break;
-    case FunctionCode::SRA:
-      register_file_[r.reg_c] =
-          *(reinterpret_cast<const int16_t *>(&b)) >> r.shift_value;
+    case Operation::SRA:
+      register_file_[d.reg_c] =
+          *(reinterpret_cast<const int16_t *>(&b)) >> d.shift_value;
       break;
-    case FunctionCode::JR:
+    case Operation::JR:
       program_counter_ = a;
+      return;
+    case Operation::SRL:
+      register_file_[d.reg_c] = b >> d.shift_value;
       break;
-    case FunctionCode::SRL:
-      register_file_[r.reg_c] = b >> r.shift_value;
-      break;
-    case FunctionCode::OR:
-      register_file_[r.reg_c] = a | b;
+    case Operation::OR:
+      register_file_[d.reg_c] = a | b;
       break;
-    case FunctionCode::SUB:
-      register_file_[r.reg_c] = a - b;
+    case Operation::SUB:
+      register_file_[d.reg_c] = a - b;
       break;
-    case FunctionCode::ADD:
-      register_file_[r.reg_c] = a + b;
+    case Operation::ADD:
+      register_file_[d.reg_c] = a + b;
       break;
-    case FunctionCode::AND:
-      register_file_[r.reg_c] = a & b;
+    case Operation::AND:
+      register_file_[d.reg_c] = a & b;
       break;
 
     default:
-      warn("Non R type instruction!");
+      warn("Invalid instruction!");
       break;
   }
 
-  // if instruction is not jr, incr PC
-  if (r.function != static_cast<uint8_t>(FunctionCode::JR))
-    program_counter_ += 4;
+  // jumps return early; everything else falls through to the next instruction
+  program_counter_ += 4;
+  register_file_[0] = 0;
 }
 
+// only copies the state; SaveStateWriter does the rest in the background
 void Emulator::save_state(const std::string &filename) {
-  std::ofstream file(filename, std::ios::binary);
-  if (!file.is_open()) {
-    std::cerr << "Error opening file for saving state." << std::endl;
-    return;
+  std::vector<byte_t> image(SAVE_STATE_SIZE);
+  auto &header = *reinterpret_cast<SaveStateHeader *>(image.data());
+  std::copy_n(SAVE_STATE_MAGIC, sizeof(header.magic), header.magic);
+  header.version = SAVE_STATE_VERSION;
+  header.byte_order = SAVE_STATE_BYTE_ORDER;
+  header.frame_count = frame_count_;
+  header.program_counter = program_counter_;
+  header.loop_address = loop_address_;
+  std::copy_n(register_file_, NUM_REGISTERS, header.registers);
+  std::copy_n(memory_.get_memory_buffer(), MEMORY_SIZE,
+              image.data() + SAVE_STATE_MEMORY_OFFSET);
+
+  SaveStateWriter::Get().write(filename, std::move(image));
+}
+
+bool Emulator::finish_saving() { return SaveStateWriter::Get().flush(); }
+
+bool Emulator::load_state(const std::string &filename) {
+  // saves still queued would otherwise race with reading the file
+  finish_saving();
+  SaveStateFile file(filename);
+  if (!file.valid()) return false;
+
+  const SaveStateHeader &header = file.header();
+  frame_count_ = header.frame_count;
+  program_counter_ = header.program_counter;
+  loop_address_ = header.loop_address;
+  std::copy_n(header.registers, NUM_REGISTERS, register_file_);
+  register_file_[0] = 0;
+
+  std::copy_n(file.memory(), MEMORY_SIZE, memory_.get_memory_buffer());
+  memory_.mark_all_pages_dirty();
+  memory_.clear_halt();
+
+  // the loaded buffer may hold a different ROM
+  memory_.predecode_rom();
+  jit_.flush();
+  idle_loops_ = std::make_shared<const IdleLoops>(memory_.get_decoded_rom());
+  if (recompiled_ != nullptr && recompiled_->rom_hash() != header.rom_hash) {
+    recompiled_.reset();
+  }
+  set_base_state();
+  restart_rewind();
+  return true;
+}
+
+namespace {
+
+constexpr char DELTA_STATE_MAGIC[4] = {'U', 'N', 'D', 'S'};
+constexpr std::uint32_t DELTA_STATE_VERSION = 1;
+constexpr size_t RAM_PAGE_COUNT = AddressSpace::RamSize / PAGE_SIZE;
+
+struct DeltaStateHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint64_t rom_hash;
+  std::uint64_t base_hash;
+  register_value_t program_counter;
+  register_value_t registers[NUM_REGISTERS];
+  // followed by this many page numbers, each with PAGE_SIZE bytes of RAM
+  std::uint16_t page_count;
+};
+
+std::uint64_t ram_hash(const byte_t *ram) {
+  return fnv1a(FNV1A_BASIS, ram, AddressSpace::RamSize);
+}
+
+}  // namespace
+
+void Emulator::set_base_state() {
+  const byte_t *ram = memory_.get_memory_buffer() + AddressSpace::RamStart;
+  base_ram_ = std::make_shared<const std::vector<byte_t>>(
+      ram, ram + AddressSpace::RamSize);
+  base_hash_ = ram_hash(ram);
+  memory_.clear_dirty_pages(DirtyTracker::DeltaState);
+}
+
+void Emulator::save_delta_state(std::ostream &out) {
+  const byte_t *memory = memory_.get_memory_buffer();
+  DeltaStateHeader header{};
+  std::copy_n(DELTA_STATE_MAGIC, sizeof(header.magic), header.magic);
+  header.version = DELTA_STATE_VERSION;
+  header.rom_hash = rom_hash(memory + AddressSpace::RomStart);
+  header.base_hash = base_hash_;
+  header.program_counter = program_counter_;
+  std::copy_n(register_file_, NUM_REGISTERS, header.registers);
+  for (size_t p = 0; p < RAM_PAGE_COUNT; p++) {
+    header.page_count += memory_.page_dirty(p, DirtyTracker::DeltaState);
+  }
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+  for (size_t p = 0; p < RAM_PAGE_COUNT; p++) {
+    if (!memory_.page_dirty(p, DirtyTracker::DeltaState)) continue;
+    std::uint16_t page = p;
+    out.write(reinterpret_cast<const char *>(&page), sizeof(page));
+    out.write(reinterpret_cast<const char *>(memory + p * PAGE_SIZE),
+              PAGE_SIZE);
+  }
+}
+
+bool Emulator::load_delta_state(std::istream &in) {
+  byte_t *memory = memory_.get_memory_buffer();
+  DeltaStateHeader header;
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in || !std::equal(std::begin(DELTA_STATE_MAGIC),
+                         std::end(DELTA_STATE_MAGIC), header.magic) ||
+      header.version != DELTA_STATE_VERSION ||
+      header.page_count > RAM_PAGE_COUNT) {
+    std::cerr << "Error loading state: not a delta state." << std::endl;
+    return false;
+  }
+  if (header.rom_hash != rom_hash(memory + AddressSpace::RomStart) ||
+      base_ram_ == nullptr || header.base_hash != base_hash_) {
+    std::cerr << "Error loading state: it was saved from another ROM or base "
+                 "state."
+              << std::endl;
+    return false;
   }
 
-  file.write(reinterpret_cast<const char *>(&program_counter_),
-             sizeof(program_counter_));
+  // read everything first, so that a truncated state changes nothing
+  std::vector<std::uint16_t> pages(header.page_count);
+  std::vector<byte_t> contents(header.page_count * PAGE_SIZE);
+  for (size_t i = 0; i < pages.size(); i++) {
+    in.read(reinterpret_cast<char *>(&pages[i]), sizeof(pages[i]));
+    in.read(reinterpret_cast<char *>(contents.data() + i * PAGE_SIZE),
+            PAGE_SIZE);
+    if (!in || pages[i] >= RAM_PAGE_COUNT) {
+      std::cerr << "Error loading state: truncated delta state." << std::endl;
+      return false;
+    }
+  }
 
-  for (int i = 0; i < NUM_REGISTERS; ++i) {
-    register_value_t regVal = *register_file_[i];
-    file.write(reinterpret_cast<const char *>(&regVal), sizeof(regVal));
+  // back to the base state, then forward to the saved one
+  for (size_t p = 0; p < RAM_PAGE_COUNT; p++) {
+    if (!memory_.page_dirty(p, DirtyTracker::DeltaState)) continue;
+    std::copy_n(base_ram_->begin() + p * PAGE_SIZE, PAGE_SIZE,
+                memory + p * PAGE_SIZE);
+    // changed all the same for the other trackers
+    memory_.mark_page_dirty(p);
   }
+  memory_.clear_dirty_pages(DirtyTracker::DeltaState);
+  for (size_t i = 0; i < pages.size(); i++) {
+    std::copy_n(contents.begin() + i * PAGE_SIZE, PAGE_SIZE,
+                memory + pages[i] * PAGE_SIZE);
+    memory_.mark_page_dirty(pages[i]);
+  }
+
+  program_counter_ = header.program_counter;
+  std::copy_n(header.registers, NUM_REGISTERS, register_file_);
+  register_file_[0] = 0;
+  return true;
+}
 
-  file.write(reinterpret_cast<const char *>(memory_.get_memory_buffer()),
-             memory_.get_memory_size());
+// history from before a new ROM or a loaded state is dropped
+void Emulator::restart_rewind() {
+  if (rewind_ == nullptr) return;
 
-  file.close();
+  rewind_->clear();
+  if (memory_.halted()) return;
+  rewind_->capture(frame_count_, register_file_, program_counter_, memory_);
 }
 
-void Emulator::load_state(const std::string &filename) {
-  std::ifstream file(filename, std::ios::binary);
-  if (!file.is_open()) {
-    std::cerr << "Error opening file for loading state." << std::endl;
-    return;
+void Emulator::enable_rewind(size_t arena_size, std::uint64_t interval) {
+  rewind_.reset();
+  if (arena_size == 0) return;
+
+  rewind_ = std::make_unique<RewindBuffer>(arena_size);
+  rewind_interval_ = std::max<std::uint64_t>(interval, 1);
+  restart_rewind();
+}
+
+std::uint64_t Emulator::rewind(std::uint64_t frames) {
+  if (rewind_ == nullptr || rewind_->empty()) return 0;
+
+  std::uint64_t target = frames < frame_count_ ? frame_count_ - frames : 0;
+  std::uint64_t frame =
+      rewind_->restore(target, register_file_, program_counter_, memory_);
+  std::uint64_t rewound = frame_count_ - frame;
+  frame_count_ = frame;
+  // the kept states are all from before any halt
+  memory_.clear_halt();
+  return rewound;
+}
+
+std::unique_ptr<Emulator> Emulator::fork(std::istream &in, std::ostream &out,
+                                         std::ostream &err) {
+  auto fork = std::make_unique<Emulator>(in, out, err);
+  std::copy_n(register_file_, NUM_REGISTERS, fork->register_file_);
+  fork->program_counter_ = program_counter_;
+  memory_.fork_into(fork->memory_);
+  fork->cont_ = cont_;
+  fork->core_ = core_;
+  fork->budget_ = budget_;
+  fork->budget_stats_ = budget_stats_;
+  fork->instruction_count_ = instruction_count_;
+  fork->frame_count_ = frame_count_;
+  fork->loop_address_ = loop_address_;
+  fork->recompiled_ = recompiled_;
+  fork->idle_loops_ = idle_loops_;
+  fork->idle_frame_count_ = idle_frame_count_;
+  fork->base_ram_ = base_ram_;
+  fork->base_hash_ = base_hash_;
+  return fork;
+}
+
+std::unique_ptr<Emulator> Emulator::fork() {
+  return fork(std::cin, std::cout, std::cerr);
+}
+
+const byte_t *Emulator::run_ahead(std::uint64_t frames) {
+  if (frames == 0 || memory_.halted()) return get_vram();
+
+  run_ahead_checkpoint_.save(register_file_, program_counter_, memory_);
+  std::uint64_t instruction_count = instruction_count_;
+  std::uint64_t frame_count = frame_count_;
+  std::uint64_t idle_frame_count = idle_frame_count_;
+  BudgetStats budget_stats = budget_stats_;
+
+  memory_.mute_console(true);
+  running_ahead_ = true;
+  for (std::uint64_t ran = 0; ran < frames && run_frame();) ran++;
+  running_ahead_ = false;
+  memory_.mute_console(false);
+  run_ahead_vram_.assign(get_vram(), get_vram() + WindowArea);
+  for (size_t p = 0; p < VRAM_PAGE_COUNT; p++) {
+    if (memory_.page_dirty(AddressSpace::VramStart / PAGE_SIZE + p,
+                           DirtyTracker::Display)) {
+      run_ahead_pages_.set(p);
+    }
   }
 
-  file.read(reinterpret_cast<char *>(&program_counter_),
-            sizeof(program_counter_));
+  run_ahead_checkpoint_.restore(register_file_, program_counter_, memory_);
+  instruction_count_ = instruction_count;
+  frame_count_ = frame_count;
+  idle_frame_count_ = idle_frame_count;
+  budget_stats_ = budget_stats;
+  memory_.clear_halt();
+  return run_ahead_vram_.data();
+}
 
-  for (int i = 0; i < NUM_REGISTERS; ++i) {
-    register_value_t regVal;
-    file.read(reinterpret_cast<char *>(&regVal), sizeof(regVal));
-    register_file_[i] = regVal;
+std::bitset<WindowHeight> Emulator::take_changed_rows() {
+  std::bitset<WindowHeight> rows;
+  for (size_t p = 0; p < VRAM_PAGE_COUNT; p++) {
+    size_t page = AddressSpace::VramStart / PAGE_SIZE + p;
+    if (!memory_.page_dirty(page, DirtyTracker::Display) &&
+        !shown_run_ahead_pages_[p]) {
+      continue;
+    }
+    memory_.clear_dirty_page(page, DirtyTracker::Display);
+    for (size_t r = 0; r < ROWS_PER_PAGE; r++) rows.set(p * ROWS_PER_PAGE + r);
   }
+  shown_run_ahead_pages_ = run_ahead_pages_;
+  run_ahead_pages_.reset();
+  return rows;
+}
 
-  file.read(reinterpret_cast<char *>(memory_.get_memory_buffer()),
-            memory_.get_memory_size());
-  file.close();
+RewindBuffer::Stats Emulator::get_rewind_stats() const {
+  if (rewind_ == nullptr) return RewindBuffer::Stats{};
+  return rewind_->get_stats();
 }
 
 register_value_t Emulator::get_register_value(const uint8_t &index) {
-  return *register_file_[index];
+  return register_file_[index];
 }
 
 MemoryIo &Emulator::get_memory() { return memory_; }
@@ -323,6 +837,7 @@ MemoryIo &Emulator::get_memory() { return memory_; }
 void Emulator::set_register_value(const uint8_t &index,
                                   const register_value_t &value) {
   register_file_[index] = value;
+  register_file_[0] = 0;
 }
 
 void Emulator::set_program_counter(const register_value_t &value) {
@@ -330,3 +845,34 @@ void Emulator::set_program_counter(const register_value_t &value) {
 }
 
 register_value_t Emulator::get_program_counter() { return program_counter_; }
+
+void Emulator::set_interpreter_core(InterpreterCore core) { core_ = core; }
+
+InterpreterCore Emulator::get_interpreter_core() { return core_; }
+
+std::uint64_t Emulator::get_instruction_count() { return instruction_count_; }
+
+std::uint64_t Emulator::get_frame_count() { return frame_count_; }
+
+std::uint64_t Emulator::get_idle_frame_count() { return idle_frame_count_; }
+
+void Emulator::set_instruction_budget(const InstructionBudget &budget) {
+  budget_ = budget;
+}
+
+BudgetStats Emulator::get_budget_stats() const { return budget_stats_; }
+
+const byte_t *Emulator::get_vram() const {
+  return memory_.get_memory_buffer() + AddressSpace::VramStart;
+}
+
+const byte_t *Emulator::get_ram() const {
+  return memory_.get_memory_buffer() + AddressSpace::RamStart;
+}
+
+ControllerState &Emulator::get_controller() { return cont_; }
+
+bool Emulator::load_recompiled_rom(const std::string &path, const Rom &rom) {
+  recompiled_ = RecompiledRom::Open(path, rom);
+  return recompiled_ != nullptr;
+}
@@ -1,59 +1,241 @@
 #pragma once
 
-#include <SDL2/SDL.h>
-
+#include <bitset>
 #include <iostream>
+#include <memory>
+#include <vector>
 
+#include "aot.h"
 #include "controller.h"
-#include "gpu.h"
+#include "idle.h"
 #include "instruction.h"
+#include "jit.h"
 #include "memory.h"
+#include "rewind.h"
 #include "rom.h"
 #include "types.h"
 
 const int NUM_REGISTERS = 32;
 
-class Register {
- private:
-  bool is_zero_;
-  register_value_t value_;
-
- public:
-  Register();
-  Register(bool is_zero);
-  Register(register_value_t value);
+// Interpreter loops that can run the pre-decoded instruction stream.
+enum class InterpreterCore {
+  // one switch over Operation per instruction
+  Switch,
+  // jumps straight from handler to handler through a table of labels
+  Threaded,
+  // runs ROM code as native x86-64 basic blocks, interpreting the rest
+  Jit,
+  // runs the recompiled ROM loaded with load_recompiled_rom
+  Aot,
+};
 
-  register_value_t operator*() const;
-  Register &operator=(register_value_t val);
+// What happens when setup or a frame runs past its instruction budget.
+enum class OverrunPolicy {
+  // print where the ROM got to and halt it
+  Abort,
+  // end the frame there; the next one carries on from where it stopped
+  Carry,
+  // undo the frame: RAM, registers and PC go back to how they were before
+  // it, and the next frame starts over. setup can't be undone, so an
+  // overrun there aborts
+  Drop,
 };
 
-using MemoryIo = Memory<std::istream, std::ostream, std::ostream>;
+// Instructions setup and each frame may run before the policy kicks in; 0
+// means no limit. Where the cores check it differs, so all but the switch
+// core can overrun it by a stretch of code without a check:
+//   Switch: every instruction
+//   Threaded: jumps and taken branches
+//   Jit: between blocks
+//   Aot: backward jumps and jr
+// Frames run ahead end at an overrun without going by the policy.
+struct InstructionBudget {
+  std::uint64_t setup = 0;
+  std::uint64_t frame = 0;
+  OverrunPolicy policy = OverrunPolicy::Abort;
+};
 
-class StopException {};
+// What ROMs actually use, to size budgets from.
+struct BudgetStats {
+  std::uint64_t setup_instructions;
+  // of the frames run since the last reset, budget or not
+  std::uint64_t last_frame_instructions;
+  std::uint64_t max_frame_instructions;
+  std::uint64_t overruns;
+  // PC when the last overrun stopped setup or a frame
+  register_value_t last_overrun_pc;
+};
 
 class Emulator {
  private:
-  Register register_file_[NUM_REGISTERS];
+  // r0 is hardwired to zero: writes to it land in the array and are undone
+  // before the next instruction reads it
+  alignas(64) register_value_t register_file_[NUM_REGISTERS];
   register_value_t program_counter_;
   MemoryIo memory_;
   ControllerState cont_;
-  Gpu gpu;
+  InterpreterCore core_;
+  std::uint64_t instruction_count_;
+  std::uint64_t frame_count_;
+  address_t loop_address_;
+  Jit jit_;
+  std::shared_ptr<const RecompiledRom> recompiled_;
+  // RAM as of the last set_base_state(), which delta states are relative to
+  std::shared_ptr<const std::vector<byte_t>> base_ram_;
+  std::uint64_t base_hash_;
+  // captures a state every rewind_interval_ frames, while enabled
+  std::unique_ptr<RewindBuffer> rewind_;
+  std::uint64_t rewind_interval_;
+  // the state run_ahead() goes back to, and the VRAM of the frame it ran
+  // ahead to
+  Checkpoint run_ahead_checkpoint_;
+  std::vector<byte_t> run_ahead_vram_;
+  // set while run_ahead() runs its frames, which end at an overrun rather
+  // than going by the budget's policy
+  bool running_ahead_;
+  // VRAM pages marked when run_ahead() last kept a frame, which that frame
+  // can differ from memory in; and these as of the last take_changed_rows(),
+  // which still count towards the next call, as that call took their marks
+  std::bitset<VRAM_PAGE_COUNT> run_ahead_pages_;
+  std::bitset<VRAM_PAGE_COUNT> shown_run_ahead_pages_;
+  // idle loops of the mounted ROM, and the last poll in one this frame: its
+  // address, the instruction count and the registers then
+  std::shared_ptr<const IdleLoops> idle_loops_;
+  address_t idle_poll_address_;
+  std::uint64_t idle_poll_count_;
+  register_value_t idle_poll_registers_[NUM_REGISTERS];
+  // set when a frame ends in an idle loop, to where the next one picks up
+  address_t idle_resume_;
+  std::uint64_t idle_frame_count_;
+  InstructionBudget budget_;
+  BudgetStats budget_stats_;
+  // the cores stop at their next budget check (see InstructionBudget) once
+  // instruction_count_ gets here
+  std::uint64_t instruction_limit_;
+  // the state before the frame, while frames are dropped on overruns
+  Checkpoint budget_checkpoint_;
 
-  void handle_event(const SDL_Event &evt);
+  byte_t load_byte(address_t a);
+  word_t load_word(address_t a);
+  bool store_byte(address_t a, byte_t byte);
+  void store_word(address_t a, word_t word);
+  bool execute_until_return(std::uint64_t budget);
+  void execute_until_return_switch();
+  void execute_until_return_threaded();
+  void execute_until_return_jit();
+  void execute_until_return_aot();
+  template <typename State, typename Native>
+  void execute_until_return_native(Native run_native);
+  void restart_rewind();
+  bool idle_poll();
+  bool run_frame();
+  void overrun(bool setup);
 
  public:
   Emulator();
+  // the ROM's stdin, stdout and stderr go to these instead of std::cin etc.
+  Emulator(std::istream &in, std::ostream &out, std::ostream &err);
 
   register_value_t get_register_value(const uint8_t &index);
   void set_register_value(const uint8_t &index, const register_value_t &value);
   void set_program_counter(const register_value_t &value);
   register_value_t get_program_counter();
-  void execute_rom(const Rom &rom);
+  void set_interpreter_core(InterpreterCore core);
+  InterpreterCore get_interpreter_core();
+  std::uint64_t get_instruction_count();
+  std::uint64_t get_frame_count();
+  /*
+   * frames ended early because the ROM was spinning in an idle loop, waiting
+   * on the controller (see IdleLoops). the next frame carries on from the
+   * poll with the new controller state, as if the loop had kept spinning.
+   */
+  std::uint64_t get_idle_frame_count();
+  // takes effect from the next setup or frame
+  void set_instruction_budget(const InstructionBudget &budget);
+  BudgetStats get_budget_stats() const;
+  // views straight into memory, valid for the emulator's lifetime. VRAM
+  // holds the frame as WindowWidth x WindowHeight grayscale bytes
+  const byte_t *get_vram() const;
+  const byte_t *get_ram() const;
+  ControllerState &get_controller();
+  bool load_recompiled_rom(const std::string &path, const Rom &rom);
+  // mounts the ROM and runs its setup function
+  void start_rom(const Rom &rom);
+  // runs the loop function of the started ROM once
+  void execute_frame();
+  // like a fresh Emulator running start_rom: registers, RAM, input and
+  // counters are cleared first. the core and recompiled ROM are kept
+  void reset(const Rom &rom);
+  // runs n frames with the controller held in the given state and returns
+  // how many ran; fewer when the ROM stops itself, after which is_halted()
+  // holds until the next reset
+  std::uint64_t step_frames(std::uint64_t n,
+                            const ControllerState &controller);
+  bool is_halted() const;
+  // starts the ROM and runs max_frames frames back to back (0 runs until the
+  // ROM stops it); pacing and input are up to the caller
+  void execute_rom(const Rom &rom, std::uint64_t max_frames = 0);
 
   void execute_I_Instruction(const ITypeInstruction &i);
   void execute_R_Instruction(const RTypeInstruction &r);
+  void execute_decoded(const DecodedInstruction &d);
+  /*
+   * save_state returns straight away and leaves writing the file to a
+   * background thread; finish_saving waits for every save so far (from any
+   * Emulator) and returns false if one failed. load_state finishes saving
+   * first, and returns false if the file isn't an intact save state.
+   */
   void save_state(const std::string &filename);
-  void load_state(const std::string &filename);
+  static bool finish_saving();
+  bool load_state(const std::string &filename);
+  /*
+   * delta states hold the registers, the hash of the ROM and of the base
+   * state, and only the RAM pages written since the base state was set.
+   * start_rom and load_state set the base state themselves, so a delta saved
+   * after start_rom loads into any emulator that started the same ROM from
+   * cleared RAM. load_delta_state returns false, changing nothing, if the
+   * ROM or base state differ.
+   */
+  void set_base_state();
+  void save_delta_state(std::ostream &out);
+  bool load_delta_state(std::istream &in);
+  /*
+   * keeps the state of every interval-th frame in memory for rewind(), as
+   * deltas in an arena of arena_size bytes; older states are dropped to make
+   * room. an arena_size of 0 turns this off again.
+   */
+  void enable_rewind(size_t arena_size, std::uint64_t interval = 1);
+  // goes back to the newest kept state at least `frames` frames old (or the
+  // oldest one kept) and returns how many frames back that was
+  std::uint64_t rewind(std::uint64_t frames);
+  // all zero while rewinding is off
+  RewindBuffer::Stats get_rewind_stats() const;
+  /*
+   * a new Emulator in the same state, whose ROM's console goes to the given
+   * streams. it shares memory pages, the decoded and recompiled ROM and the
+   * delta state base with this one until either side changes them, so forks
+   * are cheap to make and to keep around, and can run on any thread. the
+   * fork starts with an empty JIT cache and rewinding off.
+   */
+  std::unique_ptr<Emulator> fork(std::istream &in, std::ostream &out,
+                                 std::ostream &err);
+  std::unique_ptr<Emulator> fork();
+  /*
+   * hides `frames` frames of the ROM's input lag: runs that many frames
+   * with the controller as it is now, keeps the VRAM they end on and rolls
+   * everything back, then returns that VRAM (or get_vram() for 0 frames).
+   * rolling back copies only the RAM pages written since the last call.
+   * frames run ahead see no console input, their output is dropped and
+   * they aren't kept for rewinding. the view is valid until the next call.
+   */
+  const byte_t *run_ahead(std::uint64_t frames);
+  /*
+   * the rows that may differ between the frame get_vram() or run_ahead()
+   * gives now and the one either gave at the last call; for redrawing only
+   * those. it goes by the pages VRAM writes mark, so a row can be reported
+   * without having changed, but a changed row is never missed.
+   */
+  std::bitset<WindowHeight> take_changed_rows();
   MemoryIo &get_memory();
 
   // for testing
@@ -2,48 +2,121 @@
 
 #include <SDL2/SDL.h>
 
-Gpu::Gpu(Memory<std::istream, std::ostream, std::ostream> const& memory)
-    : window_(SDL_CreateWindow("SLUG", SDL_WINDOWPOS_UNDEFINED,
-                               SDL_WINDOWPOS_UNDEFINED, WindowWidth,
-                               WindowHeight, 0)),
-      surface_(SDL_GetWindowSurface(window_)),
-      toMemory_(memory),
-      pixelFormat_(SDL_AllocFormat(SDL_GetWindowPixelFormat(window_)))
+#include <algorithm>
+
+// the format frames are streamed to the renderer in
+constexpr Uint32 TEXTURE_FORMAT = SDL_PIXELFORMAT_ARGB8888;
+
+// converts to the given pixel format
+static GrayscaleBlitter make_blitter(Uint32 pixel_format, int scale) {
+  SDL_PixelFormat* format = SDL_AllocFormat(pixel_format);
+  std::uint32_t table[256];
+  for (int gray = 0; gray < 256; gray++) {
+    table[gray] = SDL_MapRGB(format, gray, gray, gray);
+  }
+  SDL_FreeFormat(format);
+  return GrayscaleBlitter(table, scale);
+}
 
-{}
+Gpu::Gpu(int scale, bool use_renderer)
+    : window_(SDL_CreateWindow("SLUG", SDL_WINDOWPOS_UNDEFINED,
+                               SDL_WINDOWPOS_UNDEFINED, WindowWidth * scale,
+                               WindowHeight * scale, 0)),
+      renderer_(nullptr),
+      texture_(nullptr),
+      surface_(nullptr),
+      scale_(scale),
+      blitter_(make_blitter(TEXTURE_FORMAT, 1)),
+      shown_(WindowArea),
+      redraw_(true) {
+  if (use_renderer) {
+    // whole multiples of the frame, with hard pixel edges
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+    renderer_ = SDL_CreateRenderer(window_, -1, 0);
+    if (renderer_ != nullptr) {
+      SDL_RenderSetLogicalSize(renderer_, WindowWidth, WindowHeight);
+      SDL_RenderSetIntegerScale(renderer_, SDL_TRUE);
+      texture_ = SDL_CreateTexture(renderer_, TEXTURE_FORMAT,
+                                   SDL_TEXTUREACCESS_STREAMING, WindowWidth,
+                                   WindowHeight);
+    }
+    if (texture_ == nullptr) {
+      warn(SDL_GetError());
+      warn("Could not create a renderer, drawing to the window surface.");
+      if (renderer_ != nullptr) SDL_DestroyRenderer(renderer_);
+      renderer_ = nullptr;
+    }
+  }
+  if (renderer_ == nullptr) {
+    surface_ = SDL_GetWindowSurface(window_);
+    blitter_ = make_blitter(SDL_GetWindowPixelFormat(window_), scale);
+  }
+}
 
 Gpu::~Gpu() {
+  if (texture_ != nullptr) SDL_DestroyTexture(texture_);
+  if (renderer_ != nullptr) SDL_DestroyRenderer(renderer_);
   SDL_DestroyWindow(window_);
-  SDL_FreeFormat(pixelFormat_);
 }
 
-// gets the pixel address for a point in the window
-address_t Gpu::getPixelAddress(const uint16_t& x, const uint16_t& y) {
-  address_t pixel_index = x + (y * WindowWidth);
-  address_t pixel_offset = 1 * pixel_index;
-  return 0x3400 + pixel_offset;
+// converts rows [first_row, last_row) of the frame, setting strip to the
+// part of the window they cover
+void Gpu::draw_strip(const byte_t* framebuffer, int first_row, int last_row,
+                     SDL_Rect& strip) {
+  int rows = last_row - first_row;
+  if (renderer_ != nullptr) {
+    // locked texture memory is write-only, so every row locked is written
+    strip = SDL_Rect{0, first_row, WindowWidth, rows};
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(texture_, &strip, &pixels, &pitch) != 0) return;
+    blitter_.blit(framebuffer, pixels, pitch, first_row, last_row);
+    SDL_UnlockTexture(texture_);
+  } else {
+    strip = SDL_Rect{0, first_row * scale_, WindowWidth * scale_,
+                     rows * scale_};
+    auto* pixels = static_cast<byte_t*>(surface_->pixels);
+    blitter_.blit(framebuffer, pixels + strip.y * surface_->pitch,
+                  surface_->pitch, first_row, last_row);
+  }
 }
 
-// renders whatever is in the frame buffer in VRAM to the window
-void Gpu::renderFrame() {
-  SDL_LockSurface(surface_);
-  address_t pixelAdr;
-  byte_t pixel;
-  uint8_t pixelColor;
-  uint32_t** surfacePixals = (uint32_t**)(&(surface_->pixels));
-
-  for (uint16_t pixelX = 0; pixelX < WindowWidth; pixelX++) {
-    for (uint16_t pixelY = 0; pixelY < WindowHeight; pixelY++) {
-      // grab the pixel from the frame buffer
-      pixelAdr = Gpu::getPixelAddress(pixelX, pixelY);
-      pixel = toMemory_.read_byte(pixelAdr);
-
-      // map that pixel onto the surface
-      (*surfacePixals)[pixelX + (pixelY * WindowWidth)] =
-          SDL_MapRGB(pixelFormat_, pixel, pixel, pixel);
-    }
+// renders the changed rows of a frame buffer out of VRAM to the window. ROMs
+// tend to redraw the whole screen every frame, so most rows written hold
+// what they did before. the window surface is updated in just the strips of
+// rows that changed; a renderer presents the whole texture, of which only
+// those strips were uploaded
+void Gpu::renderFrame(const byte_t* framebuffer,
+                      const std::bitset<WindowHeight>& changed_rows) {
+  std::bitset<WindowHeight> rows = changed_rows;
+  if (redraw_) {
+    rows.set();
+    std::copy_n(framebuffer, WindowArea, shown_.begin());
+    redraw_ = false;
+  } else {
+    keep_changed_rows(framebuffer, shown_.data(), rows);
+  }
+  if (rows.none()) return;
+
+  SDL_Rect strips[WindowHeight];
+  int strip_count = 0;
+  if (surface_ != nullptr) SDL_LockSurface(surface_);
+  for (int y = 0; y < WindowHeight; y++) {
+    if (!rows[y]) continue;
+    int end = y;
+    while (end < WindowHeight && rows[end]) end++;
+    draw_strip(framebuffer, y, end, strips[strip_count++]);
+    y = end;
+  }
+
+  if (surface_ != nullptr) {
+    SDL_UnlockSurface(surface_);
+    SDL_UpdateWindowSurfaceRects(window_, strips, strip_count);
+  } else {
+    SDL_RenderClear(renderer_);
+    SDL_RenderCopy(renderer_, texture_, nullptr, nullptr);
+    SDL_RenderPresent(renderer_);
   }
-  // render frame data to surface
-  SDL_UnlockSurface(surface_);
-  SDL_UpdateWindowSurface(window_);
 }
+
+void Gpu::redraw() { redraw_ = true; }
@@ -2,30 +2,51 @@
 
 #include <SDL2/SDL.h>
 
-#include <iostream>
+#include <bitset>
+#include <vector>
 
+#include "blit.h"
 #include "memory.h"
-#include "rom.h"
 #include "types.h"
 
-enum GpuConfig {
-  WindowHeight = 120,
-  WindowWidth = 128,
-  WindowArea = WindowHeight * WindowWidth
-};
-
+/*
+ * The SDL window frames are presented in, scale times their size. Only the
+ * frontend uses it. Frames go either onto the window surface, scaled by
+ * the CPU, or into a streaming texture that an SDL_Renderer scales; SDL
+ * falls back to its software renderer where there is no GPU.
+ */
 class Gpu {
  private:
   SDL_Window* window_;
+  // with a renderer, the texture frames are streamed into
+  SDL_Renderer* renderer_;
+  SDL_Texture* texture_;
+  // without one, the window surface, which is 32 bits per pixel
   SDL_Surface* surface_;
-  Memory<std::istream, std::ostream, std::ostream> const& toMemory_;
-  SDL_PixelFormat* pixelFormat_;
+  int scale_;
+  GrayscaleBlitter blitter_;
+  // the frame as drawn, for finding the rows that really changed
+  std::vector<byte_t> shown_;
+  // set until the next frame is drawn whole
+  bool redraw_;
 
-  static address_t getPixelAddress(const uint16_t& width,
-                                   const uint16_t& height);
+  void draw_strip(const byte_t* framebuffer, int first_row, int last_row,
+                  SDL_Rect& strip);
 
  public:
-  Gpu(Memory<std::istream, std::ostream, std::ostream> const& memory);
+  // scale is 1 to MAX_BLIT_SCALE. if use_renderer is set but no renderer can
+  // be made, says so and uses the window surface
+  Gpu(int scale, bool use_renderer);
   ~Gpu();
-  void renderFrame();
+  Gpu(const Gpu&) = delete;
+  Gpu& operator=(const Gpu&) = delete;
+
+  // draws a WindowWidth x WindowHeight grayscale frame to the window. only
+  // rows in changed_rows that differ from the last frame are drawn, and
+  // nothing is if there are none. the first frame, and the first after
+  // redraw(), is drawn whole
+  void renderFrame(const byte_t* framebuffer,
+                   const std::bitset<WindowHeight>& changed_rows);
+  // e.g. when the window has been uncovered
+  void redraw();
 };
@@ -0,0 +1,37 @@
+#include "handoff.h"
+
+FrameMailbox::FrameMailbox() : frames_(), middle_(1), back_(0), front_(2) {}
+
+void FrameMailbox::publish(const std::bitset<WindowHeight> &changed_rows) {
+  Frame &frame = frames_[back_];
+  frame.changed_rows = changed_rows | carried_rows_;
+  unsigned replaced = middle_.exchange(back_ | FRESH);
+  back_ = replaced & ~FRESH;
+  // a frame replaced before it was taken is never shown, so its changes
+  // carry on to the next frame as well
+  carried_rows_ = (replaced & FRESH) ? frame.changed_rows : changed_rows;
+}
+
+const FrameMailbox::Frame *FrameMailbox::take() {
+  if (!(middle_.load(std::memory_order_relaxed) & FRESH)) return nullptr;
+  front_ = middle_.exchange(front_) & ~FRESH;
+  return &frames_[front_];
+}
+
+InputQueue::InputQueue() : events_(), head_(0), tail_(0) {}
+
+bool InputQueue::push(const InputEvent &event) {
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  if (tail - head_.load(std::memory_order_acquire) == CAPACITY) return false;
+  events_[tail % CAPACITY] = event;
+  tail_.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+bool InputQueue::pop(InputEvent &event) {
+  size_t head = head_.load(std::memory_order_relaxed);
+  if (head == tail_.load(std::memory_order_acquire)) return false;
+  event = events_[head % CAPACITY];
+  head_.store(head + 1, std::memory_order_release);
+  return true;
+}
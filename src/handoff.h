@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+
+#include "controller.h"
+#include "memory.h"
+#include "types.h"
+
+/*
+ * What passes between the thread running an emulator and the one showing
+ * it, neither of which ever waits on the other: finished frames one way,
+ * input the other.
+ */
+
+/*
+ * A triple buffer of frames. The emulator thread fills in back() and
+ * publishes it; the presenting thread takes the newest frame published, so
+ * frames it is too slow for are skipped rather than queued.
+ */
+class FrameMailbox {
+ public:
+  struct Frame {
+    byte_t vram[WindowArea];
+    // rows that may differ from the frame taken before this one; the rows
+    // of the frame published before it are always among them
+    std::bitset<WindowHeight> changed_rows;
+  };
+
+ private:
+  // in middle_ while the frame there hasn't been taken
+  static constexpr unsigned FRESH = 4;
+
+  Frame frames_[3];
+  // the frame between the threads, which they swap theirs with
+  std::atomic<unsigned> middle_;
+  // only the emulator thread's: the frame it fills in, and the rows the next
+  // frame published has to report on top of its own
+  unsigned back_;
+  std::bitset<WindowHeight> carried_rows_;
+  // only the presenting thread's
+  unsigned front_;
+
+ public:
+  FrameMailbox();
+  FrameMailbox(const FrameMailbox &) = delete;
+  FrameMailbox &operator=(const FrameMailbox &) = delete;
+
+  Frame &back() { return frames_[back_]; }
+  // hands over back() with the rows that changed since the last frame
+  // published, replacing that frame if it hasn't been taken
+  void publish(const std::bitset<WindowHeight> &changed_rows);
+  // the newest frame published since the last call, or nullptr. valid
+  // until the next call
+  const Frame *take();
+};
+
+// a key going down or up, for the emulator thread
+struct InputEvent {
+  enum Kind : std::uint8_t {
+    Press,
+    Release,
+    RewindStart,
+    RewindStop,
+    TurboStart,
+    TurboStop,
+  };
+  Kind kind;
+  // for Press and Release
+  ControllerButton button;
+};
+
+// A ring of input events from one thread to one other.
+class InputQueue {
+ private:
+  static constexpr size_t CAPACITY = 256;
+
+  InputEvent events_[CAPACITY];
+  // next to pop, moved only by the consumer, and next to push, moved only
+  // by the producer; apart, so the threads don't share a cache line
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+
+ public:
+  InputQueue();
+  InputQueue(const InputQueue &) = delete;
+  InputQueue &operator=(const InputQueue &) = delete;
+
+  // returns false, dropping the event, if the queue is full
+  bool push(const InputEvent &event);
+  // returns false if the queue is empty
+  bool pop(InputEvent &event);
+};
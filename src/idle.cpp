@@ -0,0 +1,94 @@
+#include "idle.h"
+
+#include <algorithm>
+
+#include "memory.h"
+
+namespace {
+
+// longest loop looked for, in instructions
+constexpr size_t MAX_LOOP_LENGTH = 32;
+
+bool is_control_flow(Operation operation) {
+  switch (operation) {
+    case Operation::BEQ:
+    case Operation::BNE:
+    case Operation::J:
+    case Operation::JAL:
+    case Operation::JR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool is_poll(const DecodedInstruction &d) {
+  return d.operation == Operation::LBU && d.reg_a == 0 &&
+         d.immediate == AddressSpace::ControllerIo;
+}
+
+// whether d can be in the body of an idle loop: it reads the same for the
+// whole frame and changes nothing but registers
+bool is_idle(const DecodedInstruction &d) {
+  switch (d.operation) {
+    case Operation::LBU:
+    case Operation::LW:
+      return d.reg_a == 0 && (is_ram_address(d.immediate) || is_poll(d));
+    case Operation::SB:
+    case Operation::SW:
+    case Operation::INVALID:
+      return false;
+    default:
+      return !is_control_flow(d.operation);
+  }
+}
+
+}  // namespace
+
+IdleLoops::IdleLoops(const DecodedInstruction *rom)
+    : lengths_(ROM_INSTRUCTION_COUNT) {
+  for (size_t branch = 0; branch < ROM_INSTRUCTION_COUNT; branch++) {
+    const DecodedInstruction &d = rom[branch];
+    if (d.operation != Operation::BEQ && d.operation != Operation::BNE) {
+      continue;
+    }
+    std::int64_t target = static_cast<std::int64_t>(branch) + 1 +
+                          static_cast<std::int16_t>(d.immediate);
+    if (target < 0 || static_cast<size_t>(target) > branch ||
+        branch - target + 1 > MAX_LOOP_LENGTH) {
+      continue;
+    }
+
+    size_t start = target;
+    size_t poll = ROM_INSTRUCTION_COUNT;
+    bool idle = true;
+    for (size_t i = start; i < branch && idle; i++) {
+      idle = is_idle(rom[i]);
+      if (is_poll(rom[i])) poll = std::min(poll, i);
+    }
+    if (!idle || poll == ROM_INSTRUCTION_COUNT) continue;
+
+    // leaving the loop and coming back to the poll in as many instructions
+    // as it takes to go round would take a jump in the first poll - start
+    // instructions after the branch
+    size_t exit_end = branch + 1 + (poll - start);
+    if (exit_end > ROM_INSTRUCTION_COUNT) continue;
+    if (std::any_of(rom + branch + 1, rom + exit_end,
+                    [](const DecodedInstruction &exit) {
+                      return is_control_flow(exit.operation);
+                    })) {
+      continue;
+    }
+    lengths_[poll] = branch - start + 1;
+  }
+}
+
+std::uint8_t IdleLoops::loop_length(address_t a) const {
+  if (a < AddressSpace::RomStart || a % sizeof(instruction_t) != 0) return 0;
+  return lengths_[(a - AddressSpace::RomStart) / sizeof(instruction_t)];
+}
+
+size_t IdleLoops::count() const {
+  return lengths_.size() -
+         std::count(lengths_.begin(), lengths_.end(), std::uint8_t{0});
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "instruction.h"
+#include "types.h"
+
+/*
+ * Controller polls in idle loops, found by looking over the decoded ROM. An
+ * idle loop is a short loop with no branches but the one closing it, which
+ * stores nothing and only loads the controller or RAM at fixed addresses.
+ * Within a frame the controller doesn't change and nothing else can write
+ * RAM, so once such a loop goes round and leaves the registers as they were,
+ * it would spin until the frame's time is up. Each loop's first controller
+ * poll is noted.
+ */
+class IdleLoops {
+ private:
+  // by ROM instruction: the length of the loop polling there, or 0
+  std::vector<std::uint8_t> lengths_;
+
+ public:
+  // rom has ROM_INSTRUCTION_COUNT instructions, as Memory decodes them
+  explicit IdleLoops(const DecodedInstruction *rom);
+
+  // how many instructions go by between polls at `a` while the loop spins,
+  // or 0 if `a` isn't a poll in an idle loop
+  std::uint8_t loop_length(address_t a) const;
+  size_t count() const;
+};
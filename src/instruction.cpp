@@ -66,6 +66,97 @@ RTypeInstruction Instruction::decode_r_type() const {
   return new_instruction;
 }
 
+DecodedInstruction Instruction::predecode() const {
+  if (is_r_type()) return ::predecode(decode_r_type());
+  return ::predecode(decode_i_type());
+}
+
+DecodedInstruction predecode(const ITypeInstruction &i) {
+  DecodedInstruction decoded{Operation::INVALID, i.reg_a, i.reg_b, 0, 0,
+                             i.immediate};
+
+  switch (static_cast<Opcode>(i.opcode)) {
+    case Opcode::ORI:
+      decoded.operation = Operation::ORI;
+      break;
+    case Opcode::ADDI:
+      decoded.operation = Operation::ADDI;
+      break;
+    case Opcode::BEQ:
+      decoded.operation = Operation::BEQ;
+      break;
+    case Opcode::BNE:
+      decoded.operation = Operation::BNE;
+      break;
+    case Opcode::SB:
+      decoded.operation = Operation::SB;
+      break;
+    case Opcode::LBU:
+      decoded.operation = Operation::LBU;
+      break;
+    case Opcode::JAL:
+      decoded.operation = Operation::JAL;
+      break;
+    case Opcode::LW:
+      decoded.operation = Operation::LW;
+      break;
+    case Opcode::SW:
+      decoded.operation = Operation::SW;
+      break;
+    case Opcode::J:
+      decoded.operation = Operation::J;
+      break;
+    default:
+      break;
+  }
+
+  return decoded;
+}
+
+DecodedInstruction predecode(const RTypeInstruction &r) {
+  DecodedInstruction decoded{Operation::INVALID, r.reg_a, r.reg_b,
+                             r.reg_c, r.shift_value, 0};
+
+  if (r.opcode != static_cast<uint8_t>(Opcode::RTYPE)) return decoded;
+
+  switch (static_cast<FunctionCode>(r.function)) {
+    case FunctionCode::NOR:
+      decoded.operation = Operation::NOR;
+      break;
+    case FunctionCode::SLT:
+      decoded.operation = Operation::SLT;
+      break;
+    case FunctionCode::SLL:
+      decoded.operation = Operation::SLL;
+      break;
+    case FunctionCode::SRA:
+      decoded.operation = Operation::SRA;
+      break;
+    case FunctionCode::JR:
+      decoded.operation = Operation::JR;
+      break;
+    case FunctionCode::SRL:
+      decoded.operation = Operation::SRL;
+      break;
+    case FunctionCode::OR:
+      decoded.operation = Operation::OR;
+      break;
+    case FunctionCode::SUB:
+      decoded.operation = Operation::SUB;
+      break;
+    case FunctionCode::ADD:
+      decoded.operation = Operation::ADD;
+      break;
+    case FunctionCode::AND:
+      decoded.operation = Operation::AND;
+      break;
+    default:
+      break;
+  }
+
+  return decoded;
+}
+
 #ifndef RELEASE
 std::ostream &operator<<(std::ostream &os, Instruction i) {
   if (i.is_i_type()) {
@@ -21,6 +21,46 @@ struct RTypeInstruction {
   opcode_t function;
 };
 
+// Dense index of every I-type and R-type operation, so a pre-decoded
+// instruction can be dispatched with a single switch.
+enum class Operation : uint8_t {
+  ORI,
+  ADDI,
+  BEQ,
+  BNE,
+  SB,
+  LBU,
+  JAL,
+  LW,
+  SW,
+  J,
+  NOR,
+  SLT,
+  SLL,
+  SRA,
+  JR,
+  SRL,
+  OR,
+  SUB,
+  ADD,
+  AND,
+  INVALID,
+};
+
+// An instruction with all of its bit fields already extracted (8 bytes).
+struct DecodedInstruction {
+ public:
+  Operation operation;
+  register_index_t reg_a;
+  register_index_t reg_b;
+  register_index_t reg_c;
+  std::uint8_t shift_value;
+  immediate_t immediate;
+};
+
+DecodedInstruction predecode(const ITypeInstruction &i);
+DecodedInstruction predecode(const RTypeInstruction &r);
+
 // TODO: implement this using inheritance
 struct Instruction {
  public:
@@ -33,6 +73,7 @@ struct Instruction {
 
   ITypeInstruction decode_i_type() const;
   RTypeInstruction decode_r_type() const;
+  DecodedInstruction predecode() const;
 };
 
 #ifndef RELEASE
@@ -0,0 +1,452 @@
+#include "jit.h"
+
+#include <sys/mman.h>
+
+#include <cstddef>
+
+#include "instruction.h"
+#include "memory.h"
+
+// size of the executable arena; it is flushed and reused when full
+constexpr size_t CODE_SIZE = 4 << 20;
+// longest run of instructions translated into one block
+constexpr size_t MAX_BLOCK_INSTRUCTIONS = 64;
+// generous upper bound on the bytes one instruction translates to
+constexpr size_t MAX_INSTRUCTION_BYTES = 96;
+
+#if defined(__x86_64__)
+
+static_assert(offsetof(JitState, registers) == 0, "layout used by jit code");
+static_assert(offsetof(JitState, memory) == 64, "layout used by jit code");
+static_assert(offsetof(JitState, instruction_count) == 72,
+              "layout used by jit code");
+static_assert(offsetof(JitState, program_counter) == 80,
+              "layout used by jit code");
+static_assert(offsetof(JitState, dirty_pages) == 88,
+              "layout used by jit code");
+
+namespace {
+
+/*
+ * Emits the handful of x86-64 instructions the translator needs. Register
+ * use inside a block:
+ *   rdi  JitState *
+ *   rsi  guest memory base
+ *   eax, ecx, edx  scratch
+ */
+class Assembler {
+ private:
+  byte_t *out_;
+
+  static byte_t reg_disp(register_index_t r) {
+    return r * sizeof(register_value_t);
+  }
+
+ public:
+  enum Reg : byte_t { EAX = 0, ECX = 1, EDX = 2 };
+
+  explicit Assembler(byte_t *out) : out_(out) {}
+
+  byte_t *position() const { return out_; }
+
+  void emit(byte_t b) { *out_++ = b; }
+  void emit16(std::uint16_t v) {
+    emit(v & 0xFF);
+    emit(v >> 8);
+  }
+  void emit32(std::uint32_t v) {
+    emit16(v & 0xFFFF);
+    emit16(v >> 16);
+  }
+
+  // reg = guest register r, zero- or sign-extended; r0 reads as 0
+  void load(Reg reg, register_index_t r, bool sign_extend = false) {
+    if (r == 0) {
+      emit(0x31);  // xor reg, reg
+      emit(0xC0 | reg << 3 | reg);
+      return;
+    }
+    emit(0x0F);  // movzx/movsx reg, word [rdi + disp8]
+    emit(sign_extend ? 0xBF : 0xB7);
+    emit(0x47 | reg << 3);
+    emit(reg_disp(r));
+  }
+
+  // guest register r = low 16 bits of reg; writes to r0 are dropped
+  void store(register_index_t r, Reg reg = EAX) {
+    if (r == 0) return;
+    emit(0x66);  // mov word [rdi + disp8], reg16
+    emit(0x89);
+    emit(0x47 | reg << 3);
+    emit(reg_disp(r));
+  }
+
+  // guest register r = constant
+  void store_constant(register_index_t r, std::uint16_t value) {
+    if (r == 0) return;
+    emit(0x66);  // mov word [rdi + disp8], imm16
+    emit(0xC7);
+    emit(0x47);
+    emit(reg_disp(r));
+    emit16(value);
+  }
+
+  void set_program_counter(std::uint16_t value) {
+    emit(0x66);  // mov word [rdi + 80], imm16
+    emit(0xC7);
+    emit(0x47);
+    emit(offsetof(JitState, program_counter));
+    emit16(value);
+  }
+
+  void set_program_counter_from_eax() {
+    emit(0x66);  // mov word [rdi + 80], ax
+    emit(0x89);
+    emit(0x47);
+    emit(offsetof(JitState, program_counter));
+  }
+
+  // opcode is one of the "op eax, imm32" short forms
+  void alu_eax_imm(byte_t opcode, std::uint32_t imm) {
+    emit(opcode);
+    emit32(imm);
+  }
+
+  // opcode is one of the "op r/m32, r32" forms, applied as eax op= ecx
+  void alu_eax_ecx(byte_t opcode) {
+    emit(opcode);
+    emit(0xC8);
+  }
+
+  // ext selects shl (4), shr (5) or sar (7)
+  void shift_eax(byte_t ext, std::uint8_t amount) {
+    emit(0xC1);
+    emit(0xC0 | ext << 3);
+    emit(amount);
+  }
+
+  void mov_imm(Reg reg, std::uint32_t imm) {
+    emit(0xB8 | reg);
+    emit32(imm);
+  }
+
+  void movzx_eax_ax() {
+    emit(0x0F);
+    emit(0xB7);
+    emit(0xC0);
+  }
+
+  // byte-swap the low 16 bits of reg
+  void swap16(Reg reg) {
+    emit(0x66);  // rol reg16, 8
+    emit(0xC1);
+    emit(0xC0 | reg);
+    emit(8);
+  }
+
+  void load_memory_base() {
+    emit(0x48);  // mov rsi, [rdi + 64]
+    emit(0x8B);
+    emit(0x77);
+    emit(offsetof(JitState, memory));
+  }
+
+  // leaves the block, crediting `executed` instructions
+  void exit(size_t executed, JitExit how) {
+    if (executed > 0) {
+      emit(0x48);  // add qword [rdi + 72], imm8/imm32
+      emit(executed < 0x80 ? 0x83 : 0x81);
+      emit(0x47);
+      emit(offsetof(JitState, instruction_count));
+      if (executed < 0x80) {
+        emit(executed);
+      } else {
+        emit32(executed);
+      }
+    }
+
+    if (how == Continue) {
+      emit(0x31);  // xor eax, eax
+      emit(0xC0);
+    } else {
+      mov_imm(EAX, how);
+    }
+    emit(0xC3);  // ret
+  }
+
+  /*
+   * eax = (guest register r + imm) & 0xFFFF. unless that is a RAM address,
+   * leave the block so the interpreter can run the instruction at `at`.
+   */
+  void effective_address(register_index_t r, immediate_t imm, address_t at,
+                         size_t executed) {
+    load(EAX, r);
+    alu_eax_imm(0x05, imm);  // add eax, imm32
+    movzx_eax_ax();
+    alu_eax_imm(0x3D, AddressSpace::RamStart + AddressSpace::RamSize);
+
+    emit(0x72);  // jb over the exit
+    byte_t *patch = out_;
+    emit(0);
+    set_program_counter(at);
+    exit(executed, Interpret);
+    *patch = out_ - patch - 1;
+  }
+
+  void load_byte_from_memory() {
+    emit(0x0F);  // movzx eax, byte [rsi + rax]
+    emit(0xB6);
+    emit(0x04);
+    emit(0x06);
+  }
+
+  void load_word_from_memory() {
+    emit(0x0F);  // movzx eax, word [rsi + rax]
+    emit(0xB7);
+    emit(0x04);
+    emit(0x06);
+  }
+
+  void store_byte_to_memory() {
+    emit(0x88);  // mov byte [rsi + rax], cl
+    emit(0x0C);
+    emit(0x06);
+  }
+
+  void store_word_to_memory() {
+    emit(0x66);  // mov word [rsi + rax], cx
+    emit(0x89);
+    emit(0x0C);
+    emit(0x06);
+  }
+
+  // marks the page of the address in eax as written
+  void mark_page_dirty() {
+    emit(0x89);  // mov edx, eax
+    emit(0xC2);
+    emit(0xC1);  // shr edx, 8
+    emit(0xEA);
+    emit(8);
+    emit(0x48);  // add rdx, [rdi + 88]
+    emit(0x03);
+    emit(0x57);
+    emit(offsetof(JitState, dirty_pages));
+    emit(0xC6);  // mov byte [rdx], PAGE_WRITTEN
+    emit(0x02);
+    emit(PAGE_WRITTEN);
+  }
+
+  // eax = condition ? taken : fallthrough, then pc = eax
+  void branch(bool equal, std::uint16_t taken, std::uint16_t fallthrough) {
+    alu_eax_ecx(0x39);  // cmp eax, ecx
+    mov_imm(EAX, fallthrough);
+    mov_imm(EDX, taken);
+    emit(0x0F);  // cmove/cmovne eax, edx
+    emit(equal ? 0x44 : 0x45);
+    emit(0xC2);
+    set_program_counter_from_eax();
+  }
+
+  void set_less_than() {
+    emit(0x31);  // xor edx, edx
+    emit(0xD2);
+    alu_eax_ecx(0x39);  // cmp eax, ecx
+    emit(0x0F);         // setl dl
+    emit(0x9C);
+    emit(0xC2);
+  }
+};
+
+}  // namespace
+
+Jit::Jit() : code_(nullptr), code_used_(0), map_failed_(false) {}
+
+Jit::~Jit() {
+  if (code_ != nullptr) munmap(code_, CODE_SIZE);
+}
+
+bool Jit::supported() { return true; }
+
+void Jit::flush() {
+  code_used_ = 0;
+  if (blocks_ != nullptr) {
+    for (size_t i = 0; i < ROM_INSTRUCTION_COUNT; i++) blocks_[i] = nullptr;
+  }
+}
+
+// makes sure there is room for one more block of the largest size
+bool Jit::reserve() {
+  if (map_failed_) return false;
+  if (code_ == nullptr) {
+    void *code = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+      warn("Could not map executable memory for the JIT.");
+      map_failed_ = true;
+      return false;
+    }
+    code_ = static_cast<byte_t *>(code);
+    blocks_.reset(new jit_block_t[ROM_INSTRUCTION_COUNT]());
+  }
+
+  if (CODE_SIZE - code_used_ <
+      (MAX_BLOCK_INSTRUCTIONS + 1) * MAX_INSTRUCTION_BYTES) {
+    flush();
+  }
+  return true;
+}
+
+jit_block_t Jit::compile(const DecodedInstruction *rom, address_t pc) {
+  size_t first = (pc - AddressSpace::RomStart) / sizeof(instruction_t);
+  if (rom[first].operation == Operation::INVALID) return nullptr;
+  if (!reserve()) return nullptr;
+
+  byte_t *start = code_ + code_used_;
+  Assembler as(start);
+  as.load_memory_base();
+
+  size_t n = 0;
+  bool ended = false;
+  for (; n < MAX_BLOCK_INSTRUCTIONS && first + n < ROM_INSTRUCTION_COUNT &&
+         !ended;
+       n++) {
+    const DecodedInstruction &d = rom[first + n];
+    address_t at = pc + n * sizeof(instruction_t);
+    address_t next = at + sizeof(instruction_t);
+
+    switch (d.operation) {
+      case Operation::ORI:
+        as.load(Assembler::EAX, d.reg_a);
+        as.alu_eax_imm(0x0D, d.immediate);  // or eax, imm32
+        as.store(d.reg_b);
+        break;
+      case Operation::ADDI:
+        as.load(Assembler::EAX, d.reg_a);
+        as.alu_eax_imm(0x05, d.immediate);  // add eax, imm32
+        as.store(d.reg_b);
+        break;
+      case Operation::BEQ:
+      case Operation::BNE:
+        as.load(Assembler::EAX, d.reg_a);
+        as.load(Assembler::ECX, d.reg_b);
+        as.branch(d.operation == Operation::BEQ,
+                  at + d.immediate * 4 + sizeof(instruction_t), next);
+        ended = true;
+        break;
+      case Operation::SB:
+        as.effective_address(d.reg_a, d.immediate, at, n);
+        as.load(Assembler::ECX, d.reg_b);
+        as.store_byte_to_memory();
+        as.mark_page_dirty();
+        break;
+      case Operation::LBU:
+        as.effective_address(d.reg_a, d.immediate, at, n);
+        as.load_byte_from_memory();
+        as.store(d.reg_b);
+        break;
+      case Operation::JAL:
+        as.store_constant(31, next);
+        as.set_program_counter(d.immediate * 4);
+        ended = true;
+        break;
+      case Operation::LW:
+        // words are stored big-endian at the even address
+        as.effective_address(d.reg_a, d.immediate, at, n);
+        as.alu_eax_imm(0x25, 0xFFFE);  // and eax, imm32
+        as.load_word_from_memory();
+        as.swap16(Assembler::EAX);
+        as.store(d.reg_b);
+        break;
+      case Operation::SW:
+        as.effective_address(d.reg_a, d.immediate, at, n);
+        as.alu_eax_imm(0x25, 0xFFFE);  // and eax, imm32
+        as.load(Assembler::ECX, d.reg_b);
+        as.swap16(Assembler::ECX);
+        as.store_word_to_memory();
+        as.mark_page_dirty();
+        break;
+      case Operation::J:
+        as.set_program_counter(d.immediate * 4);
+        ended = true;
+        break;
+      case Operation::NOR:
+        as.load(Assembler::EAX, d.reg_a);
+        as.load(Assembler::ECX, d.reg_b);
+        as.alu_eax_ecx(0x09);  // or eax, ecx
+        as.emit(0xF7);         // not eax
+        as.emit(0xD0);
+        as.store(d.reg_c);
+        break;
+      case Operation::SLT:
+        as.load(Assembler::EAX, d.reg_a, true);
+        as.load(Assembler::ECX, d.reg_b, true);
+        as.set_less_than();
+        as.store(d.reg_c, Assembler::EDX);
+        break;
+      case Operation::SLL:
+        as.load(Assembler::EAX, d.reg_b);
+        as.shift_eax(4, d.shift_value);
+        as.store(d.reg_c);
+        break;
+      case Operation::SRA:
+        as.load(Assembler::EAX, d.reg_b, true);
+        as.shift_eax(7, d.shift_value);
+        as.store(d.reg_c);
+        break;
+      case Operation::JR:
+        as.load(Assembler::EAX, d.reg_a);
+        as.set_program_counter_from_eax();
+        ended = true;
+        break;
+      case Operation::SRL:
+        as.load(Assembler::EAX, d.reg_b);
+        as.shift_eax(5, d.shift_value);
+        as.store(d.reg_c);
+        break;
+      case Operation::OR:
+      case Operation::SUB:
+      case Operation::ADD:
+      case Operation::AND: {
+        static const byte_t opcodes[] = {0x09, 0x29, 0x01, 0x21};
+        as.load(Assembler::EAX, d.reg_a);
+        as.load(Assembler::ECX, d.reg_b);
+        as.alu_eax_ecx(opcodes[static_cast<int>(d.operation) -
+                               static_cast<int>(Operation::OR)]);
+        as.store(d.reg_c);
+        break;
+      }
+      case Operation::INVALID:
+        // leave it to the interpreter
+        as.set_program_counter(at);
+        as.exit(n, Continue);
+        code_used_ += as.position() - start;
+        return blocks_[first] = reinterpret_cast<jit_block_t>(start);
+    }
+  }
+
+  if (!ended) {
+    as.set_program_counter(pc + n * sizeof(instruction_t));
+  }
+  as.exit(n, Continue);
+
+  code_used_ += as.position() - start;
+  return blocks_[first] = reinterpret_cast<jit_block_t>(start);
+}
+
+#else
+
+Jit::Jit() : code_(nullptr), code_used_(0), map_failed_(false) {}
+
+Jit::~Jit() {}
+
+bool Jit::supported() { return false; }
+
+void Jit::flush() {}
+
+bool Jit::reserve() { return false; }
+
+jit_block_t Jit::compile(const DecodedInstruction *, address_t) {
+  return nullptr;
+}
+
+#endif
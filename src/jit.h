@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "instruction.h"
+#include "memory.h"
+#include "types.h"
+
+/*
+ * Guest state the generated code reads and writes. The generated code
+ * addresses these fields by their byte offsets, which are checked in jit.cpp.
+ */
+struct JitState {
+  register_value_t registers[32];
+  byte_t *memory;
+  std::uint64_t instruction_count;
+  register_value_t program_counter;
+  // Memory's dirty page map; stores set the entry of the page they hit
+  byte_t *dirty_pages;
+  // blocks don't loop, so they leave this to the caller
+  std::uint64_t instruction_limit;
+};
+
+enum JitExit : int {
+  // the block finished; continue at program_counter
+  Continue = 0,
+  // the instruction at program_counter must be run by the interpreter (it
+  // touches MMIO or ROM)
+  Interpret = 1,
+};
+
+using jit_block_t = int (*)(JitState *);
+
+/*
+ * Translates basic blocks of pre-decoded ROM code to x86-64 and caches them
+ * by start address. Blocks are compiled the first time control reaches them,
+ * so they start at the setup/loop entry points and at branch/jump targets.
+ *
+ * Loads and stores whose effective address is in RAM run natively; anything
+ * else leaves the block with JitExit::Interpret. Code outside the ROM is never
+ * compiled.
+ */
+class Jit {
+ private:
+  byte_t *code_;
+  size_t code_used_;
+  bool map_failed_;
+  std::unique_ptr<jit_block_t[]> blocks_;
+
+  bool reserve();
+  jit_block_t compile(const DecodedInstruction *rom, address_t pc);
+
+ public:
+  Jit();
+  ~Jit();
+  Jit(const Jit &) = delete;
+  Jit &operator=(const Jit &) = delete;
+
+  // false when the host isn't x86-64; every lookup then returns nullptr
+  static bool supported();
+
+  // forgets every compiled block; call whenever the ROM changes
+  void flush();
+
+  // returns the block starting at pc (which must be an aligned ROM address),
+  // compiling it first if needed. returns nullptr when the first instruction
+  // can't be compiled.
+  jit_block_t block_at(const DecodedInstruction *rom, address_t pc) {
+    size_t index = (pc - AddressSpace::RomStart) / sizeof(instruction_t);
+    if (blocks_ == nullptr || blocks_[index] == nullptr) {
+      return compile(rom, pc);
+    }
+    return blocks_[index];
+  }
+};
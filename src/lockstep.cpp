@@ -0,0 +1,390 @@
+#include "lockstep.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+constexpr size_t VECTOR_LANES = 16;
+// above every address, for when no lanes are waiting
+constexpr std::uint32_t NO_BARRIER = MEMORY_SIZE;
+
+namespace {
+
+/*
+ * The ALU instructions as lane-wise operations, each as a scalar function
+ * and, on x86-64, as a vector function over 16 lanes. Their results match
+ * execute_decoded for the same operands.
+ */
+#if defined(__x86_64__)
+#define AVX2 __attribute__((target("avx2")))
+#define VECTOR_OP(body)                                                    \
+  AVX2 static __m256i vector(__m256i a, __m256i b, __m256i imm,            \
+                             __m128i shift) {                              \
+    body;                                                                  \
+  }
+#else
+#define VECTOR_OP(body)
+#endif
+
+#define ALU_OP(name, scalar_body, vector_body)                             \
+  struct name {                                                            \
+    static register_value_t scalar(register_value_t a, register_value_t b, \
+                                   immediate_t imm, std::uint8_t shift) {  \
+      return scalar_body;                                                  \
+    }                                                                      \
+    VECTOR_OP(vector_body)                                                 \
+  };
+
+ALU_OP(OriOp, a | imm, return _mm256_or_si256(a, imm))
+ALU_OP(AddiOp, a + imm, return _mm256_add_epi16(a, imm))
+ALU_OP(NorOp, ~(a | b),
+       return _mm256_xor_si256(_mm256_or_si256(a, b),
+                               _mm256_set1_epi16(-1)))
+// ISA expects these to be signed values
+ALU_OP(SltOp, static_cast<int16_t>(a) < static_cast<int16_t>(b),
+       return _mm256_srli_epi16(_mm256_cmpgt_epi16(b, a), 15))
+ALU_OP(SllOp, b << shift, return _mm256_sll_epi16(b, shift))
+ALU_OP(SraOp, static_cast<int16_t>(b) >> shift,
+       return _mm256_sra_epi16(b, shift))
+ALU_OP(SrlOp, b >> shift, return _mm256_srl_epi16(b, shift))
+ALU_OP(OrOp, a | b, return _mm256_or_si256(a, b))
+ALU_OP(SubOp, a - b, return _mm256_sub_epi16(a, b))
+ALU_OP(AddOp, a + b, return _mm256_add_epi16(a, b))
+ALU_OP(AndOp, a & b, return _mm256_and_si256(a, b))
+
+#undef ALU_OP
+#undef VECTOR_OP
+
+#if defined(__x86_64__)
+AVX2 static __m256i load_lanes(const register_value_t *p) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+// dst = Op(a, b) in the lanes set in mask; dst may alias a or b
+template <typename Op>
+AVX2 void alu_avx2(register_value_t *dst, const register_value_t *a,
+                   const register_value_t *b, const register_value_t *mask,
+                   size_t lanes, immediate_t immediate, std::uint8_t shift) {
+  __m256i imm = _mm256_set1_epi16(immediate);
+  __m128i count = _mm_cvtsi32_si128(shift);
+
+  for (size_t i = 0; i < lanes; i += VECTOR_LANES) {
+    __m256i result = Op::vector(load_lanes(a + i), load_lanes(b + i), imm,
+                                count);
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(dst + i),
+        _mm256_blendv_epi8(load_lanes(dst + i), result, load_lanes(mask + i)));
+  }
+}
+#undef AVX2
+#endif
+
+}  // namespace
+
+LockstepEmulator::Lane::Lane() : memory(in, out, err, cont) {}
+
+LockstepEmulator::LockstepEmulator(size_t lanes)
+    : lane_count_(lanes),
+      stride_((lanes + VECTOR_LANES - 1) / VECTOR_LANES * VECTOR_LANES),
+      registers_(NUM_REGISTERS * stride_),
+      program_counters_(stride_),
+      mask_(stride_),
+      barrier_(NO_BARRIER),
+      loop_address_(0),
+      instruction_count_(0),
+      frame_count_(0),
+      simd_(simd_supported()) {
+  for (size_t i = 0; i < lanes; i++) {
+    lanes_.push_back(std::make_unique<Lane>());
+  }
+  group_.reserve(lanes);
+}
+
+bool LockstepEmulator::simd_supported() {
+#if defined(__x86_64__)
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+ControllerState &LockstepEmulator::get_controller(size_t lane) {
+  return lanes_[lane]->cont;
+}
+
+MemoryIo &LockstepEmulator::get_memory(size_t lane) {
+  return lanes_[lane]->memory;
+}
+
+register_value_t LockstepEmulator::get_register_value(size_t lane,
+                                                      register_index_t index) {
+  return row(index)[lane];
+}
+
+std::string LockstepEmulator::get_output(size_t lane) {
+  return lanes_[lane]->out.str();
+}
+
+bool LockstepEmulator::is_halted(size_t lane) {
+  return lanes_[lane]->memory.halted();
+}
+
+void LockstepEmulator::start_rom(const Rom &rom) {
+  std::fill(registers_.begin(), registers_.end(), 0);
+  for (size_t i = 0; i < lane_count_; i++) {
+    lanes_[i]->memory.mount_rom(rom);
+    // initialize stack pointer
+    row(29)[i] = 0x3400;
+    program_counters_[i] = rom.slug_setup_;
+  }
+  loop_address_ = rom.slug_loop_;
+  frame_count_ = 0;
+
+  // setup function
+  execute_until_return();
+}
+
+void LockstepEmulator::execute_frame() {
+  for (size_t i = 0; i < lane_count_; i++) {
+    if (!lanes_[i]->memory.halted()) program_counters_[i] = loop_address_;
+  }
+  execute_until_return();
+  frame_count_++;
+}
+
+// runs every lane until its function returns to address 0
+void LockstepEmulator::execute_until_return() {
+  for (;;) {
+    address_t pc = form_group();
+    if (pc == 0) return;
+
+    execute_group(pc);
+  }
+}
+
+/*
+ * gathers the lanes at the lowest PC into mask_ and group_, and returns that
+ * PC (0 when every lane has returned). barrier_ becomes the lowest PC of the
+ * lanes left waiting. code outside the ROM can differ from lane to lane, so
+ * there a group is a single lane.
+ */
+address_t LockstepEmulator::form_group() {
+  address_t pc = 0;
+  for (size_t i = 0; i < lane_count_; i++) {
+    address_t lane_pc = program_counters_[i];
+    if (lane_pc != 0 && (pc == 0 || lane_pc < pc)) pc = lane_pc;
+  }
+
+  group_.clear();
+  barrier_ = NO_BARRIER;
+  for (size_t i = 0; i < lane_count_; i++) {
+    address_t lane_pc = program_counters_[i];
+    bool member = lane_pc == pc && pc != 0 &&
+                  (pc >= AddressSpace::RomStart || group_.empty());
+    mask_[i] = member ? 0xFFFF : 0;
+    if (member) {
+      group_.push_back(i);
+    } else if (lane_pc != 0) {
+      barrier_ = std::min<std::uint32_t>(barrier_, lane_pc);
+    }
+  }
+  return pc;
+}
+
+void LockstepEmulator::leave_group(address_t pc) {
+  for (std::uint32_t i : group_) program_counters_[i] = pc;
+}
+
+// takes lanes that just halted out of the group; false if none are left
+bool LockstepEmulator::drop_halted_lanes() {
+  auto halted = [this](std::uint32_t i) {
+    if (!lanes_[i]->memory.halted()) return false;
+    program_counters_[i] = 0;
+    mask_[i] = 0;
+    return true;
+  };
+  group_.erase(std::remove_if(group_.begin(), group_.end(), halted),
+               group_.end());
+  return !group_.empty();
+}
+
+template <typename Op>
+void LockstepEmulator::execute_alu(const DecodedInstruction &d,
+                                   register_index_t dst) {
+  // writes to r0 are dropped
+  if (dst == 0) return;
+
+  register_value_t *out = row(dst);
+  const register_value_t *a = row(d.reg_a), *b = row(d.reg_b);
+
+#if defined(__x86_64__)
+  // a vector pass costs about as much as 16 scalar lanes
+  if (simd_ && group_.size() * VECTOR_LANES >= stride_) {
+    alu_avx2<Op>(out, a, b, mask_.data(), stride_, d.immediate,
+                 d.shift_value);
+    return;
+  }
+#endif
+  for (std::uint32_t i : group_) {
+    out[i] = Op::scalar(a[i], b[i], d.immediate, d.shift_value);
+  }
+}
+
+// loads and stores go lane by lane; RAM skips the page table
+void LockstepEmulator::execute_memory(const DecodedInstruction &d) {
+  register_value_t *a = row(d.reg_a), *b = row(d.reg_b);
+  // the load still happens for r0, since MMIO reads have side effects
+  register_value_t discard;
+  auto dst = [&](std::uint32_t i) -> register_value_t & {
+    return d.reg_b != 0 ? b[i] : discard;
+  };
+
+  switch (d.operation) {
+    case Operation::SB:
+      for (std::uint32_t i : group_) {
+        MemoryIo &memory = lanes_[i]->memory;
+        address_t ea = a[i] + d.immediate;
+        if (is_ram_address(ea)) {
+          memory.write_byte<AddressClass::Ram>(ea, b[i] & 0xFF);
+        } else {
+          memory.write_byte(ea, b[i] & 0xFF);
+        }
+      }
+      break;
+    case Operation::SW:
+      for (std::uint32_t i : group_) {
+        MemoryIo &memory = lanes_[i]->memory;
+        address_t ea = a[i] + d.immediate;
+        if (is_ram_address(ea)) {
+          memory.write_word<AddressClass::Ram>(ea, b[i]);
+        } else {
+          memory.write_word(ea, b[i]);
+        }
+      }
+      break;
+    case Operation::LBU:
+      for (std::uint32_t i : group_) {
+        MemoryIo &memory = lanes_[i]->memory;
+        address_t ea = a[i] + d.immediate;
+        dst(i) = is_ram_address(ea) ? memory.read_byte<AddressClass::Ram>(ea)
+                                    : memory.read_byte(ea);
+      }
+      break;
+    case Operation::LW:
+      for (std::uint32_t i : group_) {
+        MemoryIo &memory = lanes_[i]->memory;
+        address_t ea = a[i] + d.immediate;
+        dst(i) = is_ram_address(ea) ? memory.read_word<AddressClass::Ram>(ea)
+                                    : memory.read_word(ea);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/*
+ * runs the group from pc for as long as its lanes agree on where to go and
+ * stay below barrier_, and leaves their PCs behind when they return, catch
+ * up with waiting lanes, split up or all halt.
+ */
+void LockstepEmulator::execute_group(address_t pc) {
+  const MemoryIo &code = lanes_[group_[0]]->memory;
+
+  for (;;) {
+    if (pc == 0 || pc >= barrier_ ||
+        (pc < AddressSpace::RomStart && group_.size() > 1)) {
+      leave_group(pc);
+      return;
+    }
+
+    DecodedInstruction d = code.read_decoded_instruction(pc);
+    instruction_count_ += group_.size();
+    address_t next = pc + 4;
+
+    switch (d.operation) {
+      case Operation::ORI:
+        execute_alu<OriOp>(d, d.reg_b);
+        break;
+      case Operation::ADDI:
+        execute_alu<AddiOp>(d, d.reg_b);
+        break;
+      case Operation::NOR:
+        execute_alu<NorOp>(d, d.reg_c);
+        break;
+      case Operation::SLT:
+        execute_alu<SltOp>(d, d.reg_c);
+        break;
+      case Operation::SLL:
+        execute_alu<SllOp>(d, d.reg_c);
+        break;
+      case Operation::SRA:
+        execute_alu<SraOp>(d, d.reg_c);
+        break;
+      case Operation::SRL:
+        execute_alu<SrlOp>(d, d.reg_c);
+        break;
+      case Operation::OR:
+        execute_alu<OrOp>(d, d.reg_c);
+        break;
+      case Operation::SUB:
+        execute_alu<SubOp>(d, d.reg_c);
+        break;
+      case Operation::ADD:
+        execute_alu<AddOp>(d, d.reg_c);
+        break;
+      case Operation::AND:
+        execute_alu<AndOp>(d, d.reg_c);
+        break;
+      case Operation::SB:
+      case Operation::SW:
+      case Operation::LBU:
+      case Operation::LW:
+        execute_memory(d);
+        if (!drop_halted_lanes()) return;
+        break;
+      case Operation::JAL: {
+        register_value_t *ra = row(31);
+        for (std::uint32_t i : group_) ra[i] = next;
+        next = d.immediate * 4;
+        break;
+      }
+      case Operation::J:
+        next = d.immediate * 4;
+        break;
+      case Operation::BEQ:
+      case Operation::BNE:
+      case Operation::JR: {
+        const register_value_t *a = row(d.reg_a), *b = row(d.reg_b);
+        address_t taken = next + d.immediate * 4;
+        auto target = [&](std::uint32_t i) -> address_t {
+          switch (d.operation) {
+            case Operation::BEQ:
+              return a[i] == b[i] ? taken : next;
+            case Operation::BNE:
+              return a[i] != b[i] ? taken : next;
+            default:
+              return a[i];
+          }
+        };
+
+        address_t first = target(group_[0]);
+        bool uniform = true;
+        for (std::uint32_t i : group_) {
+          program_counters_[i] = target(i);
+          uniform = uniform && program_counters_[i] == first;
+        }
+        if (!uniform) return;
+        next = first;
+        break;
+      }
+      default:
+        warn("Invalid instruction!");
+        break;
+    }
+
+    pc = next;
+  }
+}
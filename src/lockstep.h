@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "controller.h"
+#include "emulator.h"
+#include "memory.h"
+#include "rom.h"
+#include "types.h"
+
+/*
+ * Runs N instances ("lanes") of the same ROM in lockstep, e.g. to try many
+ * controller inputs at once. Registers are kept as uint16_t[32][N] so that
+ * lanes at the same PC execute each ALU instruction as one pass of 16-bit
+ * vector operations (AVX2 when the host has it). Every lane has its own
+ * memory, controller and output; loads and stores run lane by lane.
+ *
+ * Lanes split up when a branch or JR sends them different ways. The lanes
+ * with the lowest PC always run first while the others wait, so lanes that
+ * fell behind catch up and merge with them where control flow joins again.
+ */
+class LockstepEmulator {
+ private:
+  struct Lane {
+    ControllerState cont;
+    std::istringstream in;
+    std::ostringstream out;
+    std::ostringstream err;
+    MemoryIo memory;
+
+    Lane();
+  };
+
+  size_t lane_count_;
+  // lanes rounded up to a multiple of the vector width; the padding lanes
+  // are never active
+  size_t stride_;
+  std::vector<std::unique_ptr<Lane>> lanes_;
+  // register r of lane i is registers_[r * stride_ + i]
+  std::vector<register_value_t> registers_;
+  std::vector<address_t> program_counters_;
+  // lanes executing together: 0xFFFF in mask_ and listed in group_
+  std::vector<register_value_t> mask_;
+  std::vector<std::uint32_t> group_;
+  // the group stops when it gets this far, to merge with the lanes there
+  std::uint32_t barrier_;
+  address_t loop_address_;
+  std::uint64_t instruction_count_;
+  std::uint64_t frame_count_;
+  bool simd_;
+
+  register_value_t *row(register_index_t r) {
+    return registers_.data() + r * stride_;
+  }
+
+  void execute_until_return();
+  address_t form_group();
+  void execute_group(address_t pc);
+  void leave_group(address_t pc);
+  bool drop_halted_lanes();
+  template <typename Op>
+  void execute_alu(const DecodedInstruction &d, register_index_t dst);
+  void execute_memory(const DecodedInstruction &d);
+
+ public:
+  explicit LockstepEmulator(size_t lanes);
+  LockstepEmulator(const LockstepEmulator &) = delete;
+  LockstepEmulator &operator=(const LockstepEmulator &) = delete;
+
+  // true when the ALU runs on AVX2; otherwise it loops over the lanes
+  static bool simd_supported();
+
+  size_t get_lane_count() const { return lane_count_; }
+  ControllerState &get_controller(size_t lane);
+  MemoryIo &get_memory(size_t lane);
+  register_value_t get_register_value(size_t lane, register_index_t index);
+  // what the lane wrote to stdout so far
+  std::string get_output(size_t lane);
+  // lanes that wrote to StopExecution don't run any more frames
+  bool is_halted(size_t lane);
+  // summed over all lanes
+  std::uint64_t get_instruction_count() const { return instruction_count_; }
+  std::uint64_t get_frame_count() const { return frame_count_; }
+
+  // mounts the ROM in every lane and runs its setup function
+  void start_rom(const Rom &rom);
+  // runs the loop function once in every lane that hasn't halted
+  void execute_frame();
+};
@@ -0,0 +1,119 @@
+#include "memory.h"
+
+#include <new>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <mutex>
+
+struct MemoryBuffer::SnapshotFile {
+  int fd;
+
+  ~SnapshotFile() { close(fd); }
+};
+
+MemoryBuffer::MemoryBuffer() {
+  void *data = mmap(nullptr, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) throw std::bad_alloc();
+  data_ = static_cast<byte_t *>(data);
+}
+
+MemoryBuffer::~MemoryBuffer() { munmap(data_, MEMORY_SIZE); }
+
+// every snapshot holds a file descriptor open for as long as anything maps
+// it, so the soft limit on those caps how many forks can share memory.
+// raises it to the hard limit; returns whether it went up
+static bool raise_file_limit() {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 ||
+      limit.rlim_cur >= limit.rlim_max) {
+    return false;
+  }
+  limit.rlim_cur = limit.rlim_max;
+  return setrlimit(RLIMIT_NOFILE, &limit) == 0;
+}
+
+// a new, empty snapshot file, or -1 with errno set
+static int create_snapshot_file() {
+  static std::once_flag raised;
+  std::call_once(raised, []() { raise_file_limit(); });
+  int fd = memfd_create("unengine-memory", MFD_CLOEXEC);
+  // the limit may have been lowered again since
+  if (fd < 0 && errno == EMFILE && raise_file_limit()) {
+    fd = memfd_create("unengine-memory", MFD_CLOEXEC);
+  }
+  return fd;
+}
+
+// replaces the pages at `at` with a private mapping of the snapshot
+bool MemoryBuffer::map_snapshot(byte_t *at) {
+  void *mapped = mmap(nullptr, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, snapshot_->fd, 0);
+  if (mapped == MAP_FAILED) return false;
+
+  // moving the new mapping over the old one swaps them in one step, so the
+  // buffer never moves and never goes missing
+  if (mremap(mapped, MEMORY_SIZE, MEMORY_SIZE, MREMAP_MAYMOVE | MREMAP_FIXED,
+             at) == MAP_FAILED) {
+    munmap(mapped, MEMORY_SIZE);
+    return false;
+  }
+  return true;
+}
+
+void MemoryBuffer::fork_into(MemoryBuffer &fork, bool written) {
+  bool out_of_files = false;
+  if (snapshot_ == nullptr || written) {
+    snapshot_.reset();
+    int fd = create_snapshot_file();
+    out_of_files = fd < 0 && errno == EMFILE;
+    if (fd >= 0) {
+      std::shared_ptr<const SnapshotFile> snapshot(new SnapshotFile{fd});
+      if (pwrite(fd, data_, MEMORY_SIZE, 0) ==
+          static_cast<ssize_t>(MEMORY_SIZE)) {
+        snapshot_ = snapshot;
+      }
+    }
+    // the file holds what data_ does, so this only changes where the
+    // unwritten pages come from
+    if (snapshot_ != nullptr && !map_snapshot(data_)) snapshot_.reset();
+  }
+
+  if (snapshot_ != nullptr) {
+    fork.snapshot_ = snapshot_;
+    if (fork.map_snapshot(fork.data_)) return;
+    fork.snapshot_.reset();
+  }
+
+  // enough live forks run out of file descriptors, which is only worth
+  // saying once
+  static std::atomic<bool> warned_out_of_files(false);
+  if (!out_of_files) {
+    warn("Could not share memory with a fork, copying it instead.");
+  } else if (!warned_out_of_files.exchange(true)) {
+    warn("Too many forks to share memory with them all, copying it instead.");
+  }
+  std::memcpy(fork.data_, data_, MEMORY_SIZE);
+}
+
+#else
+
+struct MemoryBuffer::SnapshotFile {};
+
+MemoryBuffer::MemoryBuffer() : data_(new byte_t[MEMORY_SIZE]()) {}
+
+MemoryBuffer::~MemoryBuffer() { delete[] data_; }
+
+bool MemoryBuffer::map_snapshot(byte_t *) { return false; }
+
+void MemoryBuffer::fork_into(MemoryBuffer &fork, bool) {
+  std::memcpy(fork.data_, data_, MEMORY_SIZE);
+}
+
+#endif
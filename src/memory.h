@@ -1,10 +1,13 @@
 #pragma once
 
+#include <algorithm>
 #include <cstring>
+#include <iostream>
 #include <memory>
 #include <vector>
 
 #include "controller.h"
+#include "instruction.h"
 #include "rom.h"
 #include "types.h"
 
@@ -33,7 +36,110 @@ enum Addresses : address_t {
 };
 }
 
+// the screen; VRAM holds one grayscale byte per pixel, row by row
+enum GpuConfig {
+  WindowHeight = 120,
+  WindowWidth = 128,
+  WindowArea = WindowHeight * WindowWidth
+};
+
 constexpr size_t MEMORY_SIZE = 0x10000;
+constexpr size_t ROM_INSTRUCTION_COUNT =
+    (MEMORY_SIZE - AddressSpace::RomStart) / sizeof(instruction_t);
+
+// granularity of the page table; all region and device bounds line up on it
+constexpr size_t PAGE_SIZE = 0x100;
+constexpr size_t PAGE_COUNT = MEMORY_SIZE / PAGE_SIZE;
+// VRAM is made of whole pages, each holding whole rows
+constexpr size_t VRAM_PAGE_COUNT = WindowArea / PAGE_SIZE;
+constexpr size_t ROWS_PER_PAGE = PAGE_SIZE / WindowWidth;
+static_assert(AddressSpace::VramStart % PAGE_SIZE == 0 &&
+                  WindowArea % PAGE_SIZE == 0 && PAGE_SIZE % WindowWidth == 0,
+              "VRAM pages hold whole rows");
+
+// Where an access is known to land, so the checks can be skipped.
+enum class AddressClass {
+  // RamStart..RamStart + RamSize: plain read/write memory
+  Ram,
+  // RomStart..MEMORY_SIZE: read-only
+  Rom,
+  // a readable/writable register of a mapped device
+  Mmio,
+};
+
+/*
+ * Users of the dirty page map. A write marks its page for all of them, and
+ * each clears only its own bit once it has looked at the page.
+ */
+enum class DirtyTracker : byte_t {
+  DeltaState = 1 << 0,
+  Rewind = 1 << 1,
+  Fork = 1 << 2,
+  RunAhead = 1 << 3,
+  Budget = 1 << 4,
+  Display = 1 << 5,
+};
+
+// what a write stores in the dirty page map
+constexpr byte_t PAGE_WRITTEN = 0xFF;
+
+constexpr bool is_ram_address(address_t a) {
+  return a < AddressSpace::RamStart + AddressSpace::RamSize;
+}
+
+/*
+ * A memory-mapped I/O device owning one page. Addresses are absolute, and
+ * only byte accesses reach a device.
+ */
+class MmioDevice {
+ public:
+  virtual ~MmioDevice() = default;
+  virtual permission_t perms(address_t a) const = 0;
+  virtual byte_t read_byte(address_t a) = 0;
+  virtual void write_byte(address_t a, byte_t byte) = 0;
+};
+
+// one page table entry: plain memory, a device, or nothing
+struct Page {
+  // permissions of plain memory; zero for device and unmapped pages
+  permission_t perms;
+  // this page of the memory buffer
+  byte_t *data;
+  MmioDevice *device;
+};
+
+/*
+ * The MEMORY_SIZE bytes behind a Memory, zeroed to start with. fork_into
+ * makes another buffer hold the same bytes by mapping both from one snapshot
+ * file, so the pages are shared until either side writes to them; the host
+ * copies a page on its first write. Where that isn't available (anything but
+ * Linux) it copies the bytes.
+ */
+class MemoryBuffer {
+ private:
+  struct SnapshotFile;
+
+  byte_t *data_;
+  // what data_ is mapped from; null while it is anonymous memory
+  std::shared_ptr<const SnapshotFile> snapshot_;
+
+  bool map_snapshot(byte_t *at);
+
+ public:
+  MemoryBuffer();
+  ~MemoryBuffer();
+  MemoryBuffer(const MemoryBuffer &) = delete;
+  MemoryBuffer &operator=(const MemoryBuffer &) = delete;
+
+  byte_t *get() { return data_; }
+  const byte_t *get() const { return data_; }
+  byte_t &operator[](size_t i) { return data_[i]; }
+  const byte_t &operator[](size_t i) const { return data_[i]; }
+
+  // `written` says whether this buffer changed since it was last forked or
+  // forked from; if not, its current snapshot is reused
+  void fork_into(MemoryBuffer &fork, bool written);
+};
 
 /* On endianness:
  *
@@ -46,39 +152,155 @@ constexpr size_t MEMORY_SIZE = 0x10000;
 template <typename In, typename Err, typename Out>
 class Memory {
  private:
-  In &in_;
-  Out &out_;
-  Err &err_;
-  ControllerState &controller_;
+  class ControllerDevice : public MmioDevice {
+   private:
+    ControllerState &controller_;
+
+   public:
+    ControllerDevice(ControllerState &controller) : controller_(controller) {}
+
+    permission_t perms(address_t a) const override {
+      return a == AddressSpace::ControllerIo ? Read : 0;
+    }
+
+    byte_t read_byte(address_t a) override { return controller_.state(); }
+
+    void write_byte(address_t a, byte_t byte) override {}
+  };
+
+  class ConsoleDevice : public MmioDevice {
+   private:
+    In &in_;
+    Out &out_;
+    Err &err_;
+    bool muted_;
+
+   public:
+    ConsoleDevice(In &in, Out &out, Err &err)
+        : in_(in), out_(out), err_(err), muted_(false) {}
+
+    void mute(bool muted) { muted_ = muted; }
+
+    permission_t perms(address_t a) const override {
+      using namespace AddressSpace;
+      if (a == Stdin) return Read;
+      if (a == Stdout || a == Stderr) return Write;
+      return 0;
+    }
+
+    byte_t read_byte(address_t a) override {
+      if (muted_) return 0;
+      // stays 0 once the input runs out
+      byte_t b = 0;
+      in_ >> b;
+      return b;
+    }
+
+    void write_byte(address_t a, byte_t byte) override {
+      if (muted_) return;
+      if (a == AddressSpace::Stdout) {
+        out_ << byte;
+      } else {
+        err_ << byte;
+      }
+    }
+  };
+
+  // any write halts the ROM; the interpreter notices when the store returns
+  class StopDevice : public MmioDevice {
+   private:
+    bool halted_;
+
+   public:
+    StopDevice() : halted_(false) {}
+
+    bool halted() const { return halted_; }
+    void halt() { halted_ = true; }
+    void clear() { halted_ = false; }
+
+    permission_t perms(address_t a) const override {
+      return a == AddressSpace::StopExecution ? Write : 0;
+    }
+
+    byte_t read_byte(address_t a) override { return 0; }
+
+    void write_byte(address_t a, byte_t byte) override { halted_ = true; }
+  };
+
+  MemoryBuffer buffer_;
 
-  stopper_fn_t stopper_;
+  // the ROM is never writable, so it is decoded once and fetched from here
+  // shared by forks until one of them mounts another ROM
+  std::shared_ptr<DecodedInstruction[]> decoded_rom_;
 
-  std::unique_ptr<byte_t[]> buffer_;
+  ControllerDevice controller_device_;
+  ConsoleDevice console_device_;
+  StopDevice stop_device_;
+
+  Page pages_[PAGE_COUNT];
+
+  // one byte per page, with a bit per DirtyTracker; writes set all of them
+  // so that native code can mark a page with a single store
+  byte_t dirty_pages_[PAGE_COUNT];
 
   Memory() = delete;
 
+  void mark_region_dirty(address_t start, size_t size) {
+    if (size == 0) return;
+    std::memset(dirty_pages_ + start / PAGE_SIZE, PAGE_WRITTEN,
+                (start + size - 1) / PAGE_SIZE - start / PAGE_SIZE + 1);
+  }
+
+  // what the zeroed ROM region decodes to, shared by every new Memory
+  static std::shared_ptr<DecodedInstruction[]> blank_decoded_rom() {
+    static const std::shared_ptr<DecodedInstruction[]> blank = [] {
+      std::shared_ptr<DecodedInstruction[]> rom(
+          new DecodedInstruction[ROM_INSTRUCTION_COUNT]);
+      std::fill_n(rom.get(), ROM_INSTRUCTION_COUNT,
+                  Instruction{0}.predecode());
+      return rom;
+    }();
+    return blank;
+  }
+
+  void map_region(address_t start, size_t size, permission_t perms) {
+    for (size_t p = start / PAGE_SIZE; p < (start + size) / PAGE_SIZE; p++) {
+      pages_[p] = Page{perms, buffer_.get() + p * PAGE_SIZE, nullptr};
+    }
+  }
+
  protected:
   permission_t perms_at_address(address_t a) const {
-    using namespace AddressSpace;
-    if (a < RamStart + RamSize) return Read | Write;
-    if (a == ControllerIo) return Read;
-    if (a == Stdin) return Read;
-    if (a == Stdout) return Write;
-    if (a == Stderr) return Write;
-    if (a == StopExecution) return Write;
-    if (a >= RomStart) return Read | Execute;
-    return 0;
+    const Page &page = pages_[a / PAGE_SIZE];
+    if (page.device != nullptr) return page.device->perms(a);
+    return page.perms;
   }
 
  public:
-  Memory(In &in, Out &out, Err &err, ControllerState &controller,
-         const stopper_fn_t &stopper)
-      : in_(in),
-        out_(out),
-        err_(err),
-        controller_(controller),
-        stopper_(stopper),
-        buffer_(new byte_t[MEMORY_SIZE]()) {}
+  Memory(In &in, Out &out, Err &err, ControllerState &controller)
+      : decoded_rom_(blank_decoded_rom()),
+        controller_device_(controller),
+        console_device_(in, out, err),
+        dirty_pages_() {
+    using namespace AddressSpace;
+    map_region(0, MEMORY_SIZE, 0);
+    map_region(RamStart, RamSize, Read | Write);
+    map_region(RomStart, MEMORY_SIZE - RomStart, Read | Execute);
+    map_device(ControllerIo, &controller_device_);
+    map_device(Stdin, &console_device_);
+    map_device(StopExecution, &stop_device_);
+  }
+
+  // the page table points into this object
+  Memory(const Memory &) = delete;
+  Memory &operator=(const Memory &) = delete;
+
+  // routes every access to the page containing `a` to `device`, which must
+  // outlive this Memory
+  void map_device(address_t a, MmioDevice *device) {
+    pages_[a / PAGE_SIZE] =
+        Page{0, buffer_.get() + a / PAGE_SIZE * PAGE_SIZE, device};
+  }
 
   const byte_t *get_memory_buffer() const { return buffer_.get(); }
 
@@ -87,77 +309,104 @@ class Memory {
   size_t get_memory_size() const { return MEMORY_SIZE; }
 
   byte_t read_byte(address_t a) const {
-    using namespace AddressSpace;
-    if ((perms_at_address(a) & Read) == 0) {
-      warn("Invalid read, returning 0.");
-      return 0;
-    }
+    const Page &page = pages_[a / PAGE_SIZE];
+    if (page.perms & Read) return page.data[a % PAGE_SIZE];
 
-    if (a == ControllerIo) return controller_.state();
-    if (a == Stdin) {
-      byte_t b;
-      in_ >> b;
-      return b;
+    if (page.device != nullptr && (page.device->perms(a) & Read)) {
+      return page.device->read_byte(a);
     }
 
-    return buffer_.get()[a];
+    warn("Invalid read, returning 0.");
+    return 0;
   }
 
   word_t read_word(address_t a) const {
-    using namespace AddressSpace;
-    if ((perms_at_address(a) & Read) == 0) {
-      warn("Invalid read, returning 0.");
-      return 0;
+    const Page &page = pages_[a / PAGE_SIZE];
+    if (page.perms & Read) {
+      address_t aligned_offset = a % PAGE_SIZE & ~(sizeof(word_t) - 1);
+      return ntohs(
+          *reinterpret_cast<const word_t *>(page.data + aligned_offset));
     }
-    if (a == Stdin || a == ControllerIo) {
+
+    if (page.device != nullptr && (page.device->perms(a) & Read)) {
       warn("Invalid word-read on byte IO, returning 0.");
       return 0;
     }
 
-    address_t aligned_address = a / sizeof(word_t);
-
-    return ntohs((reinterpret_cast<word_t *>(buffer_.get()))[aligned_address]);
+    warn("Invalid read, returning 0.");
+    return 0;
   }
 
   void write_byte(address_t a, byte_t byte) {
-    using namespace AddressSpace;
-    if ((perms_at_address(a) & Write) == 0) {
-      warn("Invalid write, performing nop.");
+    const Page &page = pages_[a / PAGE_SIZE];
+    if (page.perms & Write) {
+      page.data[a % PAGE_SIZE] = byte;
+      dirty_pages_[a / PAGE_SIZE] = PAGE_WRITTEN;
       return;
     }
 
-    if (a == Stdout) {
-      out_ << byte;
+    if (page.device != nullptr && (page.device->perms(a) & Write)) {
+      page.device->write_byte(a, byte);
       return;
     }
 
-    if (a == Stderr) {
-      err_ << byte;
+    warn("Invalid write, performing nop.");
+  }
+
+  void write_word(address_t a, word_t word) {
+    const Page &page = pages_[a / PAGE_SIZE];
+    if (page.perms & Write) {
+      address_t aligned_offset = a % PAGE_SIZE & ~(sizeof(word_t) - 1);
+      *reinterpret_cast<word_t *>(page.data + aligned_offset) = htons(word);
+      dirty_pages_[a / PAGE_SIZE] = PAGE_WRITTEN;
       return;
     }
 
-    if (a == StopExecution) {
-      stopper_();
+    if (page.device != nullptr && (page.device->perms(a) & Write)) {
+      warn("Invalid word-size IO write; performing nop");
       return;
     }
 
-    buffer_.get()[a] = byte;
+    warn("Invalid write, performing nop.");
   }
 
-  void write_word(address_t a, word_t word) {
-    using namespace AddressSpace;
-    if ((perms_at_address(a) & Write) == 0) {
-      warn("Invalid write, performing nop.");
-      return;
+  /*
+   * unchecked accessors for callers that already know the address class of
+   * `a` (e.g. with is_ram_address); using the wrong class is undefined.
+   */
+  template <AddressClass C>
+  byte_t read_byte(address_t a) const {
+    if constexpr (C == AddressClass::Mmio) {
+      return pages_[a / PAGE_SIZE].device->read_byte(a);
+    } else {
+      return buffer_[a];
     }
+  }
 
-    if (a == Stdout || a == Stderr || a == StopExecution) {
-      warn("Invalid word-size IO write; performing nop");
-      return;
+  template <AddressClass C>
+  word_t read_word(address_t a) const {
+    static_assert(C != AddressClass::Mmio, "devices are byte-sized");
+    return ntohs(reinterpret_cast<const word_t *>(
+        buffer_.get())[a / sizeof(word_t)]);
+  }
+
+  template <AddressClass C>
+  void write_byte(address_t a, byte_t byte) {
+    static_assert(C != AddressClass::Rom, "the ROM isn't writable");
+    if constexpr (C == AddressClass::Mmio) {
+      pages_[a / PAGE_SIZE].device->write_byte(a, byte);
+    } else {
+      buffer_[a] = byte;
+      dirty_pages_[a / PAGE_SIZE] = PAGE_WRITTEN;
     }
+  }
 
-    address_t aligned_address = a / sizeof(word_t);
-    reinterpret_cast<word_t *>(buffer_.get())[aligned_address] = htons(word);
+  template <AddressClass C>
+  void write_word(address_t a, word_t word) {
+    static_assert(C == AddressClass::Ram, "only RAM takes word writes");
+    reinterpret_cast<word_t *>(buffer_.get())[a / sizeof(word_t)] =
+        htons(word);
+    dirty_pages_[a / PAGE_SIZE] = PAGE_WRITTEN;
   }
 
   /*
@@ -178,13 +427,105 @@ class Memory {
         buffer_.get())[aligned_address]);
   }
 
+  /*
+   * fetches an already decoded instruction; only code outside the ROM (e.g.
+   * running out of RAM) is decoded on the fly.
+   */
+  DecodedInstruction read_decoded_instruction(address_t a) const {
+    if (a >= AddressSpace::RomStart) {
+      return decoded_rom_[(a - AddressSpace::RomStart) /
+                          sizeof(instruction_t)];
+    }
+
+    return Instruction{read_instruction(a)}.predecode();
+  }
+
+  // the decoded ROM, indexed by (address - RomStart) / 4
+  const DecodedInstruction *get_decoded_rom() const {
+    return decoded_rom_.get();
+  }
+
+  /*
+   * rebuilds the decoded copy of the ROM region. must be called again after
+   * the ROM bytes are changed through get_memory_buffer().
+   */
+  void predecode_rom() {
+    if (decoded_rom_.use_count() > 1) {
+      decoded_rom_.reset(new DecodedInstruction[ROM_INSTRUCTION_COUNT]);
+    }
+    for (size_t i = 0; i < ROM_INSTRUCTION_COUNT; i++) {
+      address_t a = AddressSpace::RomStart + i * sizeof(instruction_t);
+      decoded_rom_[i] = Instruction{read_instruction(a)}.predecode();
+    }
+  }
+
+  // set once the ROM writes to StopExecution, until a ROM is mounted again
+  bool halted() const { return stop_device_.halted(); }
+  // stops the ROM as if it had written to StopExecution
+  void halt() { stop_device_.halt(); }
+  void clear_halt() { stop_device_.clear(); }
+
+  // while muted, the console drops output and reads give 0 without taking
+  // anything from the input stream
+  void mute_console(bool muted) { console_device_.mute(muted); }
+
+  /*
+   * pages written since the tracker last cleared its bits. writes through
+   * get_memory_buffer() aren't seen; whoever makes them marks the pages.
+   */
+  bool page_dirty(size_t page, DirtyTracker tracker) const {
+    return dirty_pages_[page] & static_cast<byte_t>(tracker);
+  }
+  void mark_page_dirty(size_t page) { dirty_pages_[page] = PAGE_WRITTEN; }
+  void mark_all_pages_dirty() {
+    std::memset(dirty_pages_, PAGE_WRITTEN, PAGE_COUNT);
+  }
+  void clear_dirty_page(size_t page, DirtyTracker tracker) {
+    dirty_pages_[page] &= ~static_cast<byte_t>(tracker);
+  }
+  void clear_dirty_pages(DirtyTracker tracker) {
+    for (byte_t &page : dirty_pages_) page &= ~static_cast<byte_t>(tracker);
+  }
+  // the map itself, indexed by address / PAGE_SIZE, for generated code
+  byte_t *get_dirty_pages() { return dirty_pages_; }
+
+  void clear_ram() {
+    std::memset(buffer_.get() + AddressSpace::RamStart, 0,
+                AddressSpace::RamSize);
+    mark_region_dirty(AddressSpace::RamStart, AddressSpace::RamSize);
+  }
+
   void mount_rom(const Rom &rom) {
+    clear_halt();
     std::memcpy(buffer_.get() + AddressSpace::RomStart, rom.contents().get(),
                 SLUGValues::FILE_SIZE);
+    mark_region_dirty(AddressSpace::RomStart, SLUGValues::FILE_SIZE);
 
     // copy rom RAM to RAM
     std::memcpy(buffer_.get() + rom.slug_program_data_address_,
                 rom.contents().get() + rom.slug_load_data_address_ - 0x8000,
                 rom.slug_size_);
+    mark_region_dirty(rom.slug_program_data_address_, rom.slug_size_);
+
+    predecode_rom();
+  }
+
+  /*
+   * makes `fork` hold the same contents (and halt flag), sharing pages and
+   * the decoded ROM with it until either side changes them. the devices
+   * stay its own.
+   */
+  void fork_into(Memory &fork) {
+    bool written = false;
+    for (size_t p = 0; p < PAGE_COUNT; p++) {
+      written |= page_dirty(p, DirtyTracker::Fork);
+    }
+    clear_dirty_pages(DirtyTracker::Fork);
+    buffer_.fork_into(fork.buffer_, written);
+    std::memcpy(fork.dirty_pages_, dirty_pages_, PAGE_COUNT);
+    fork.decoded_rom_ = decoded_rom_;
+    fork.stop_device_ = stop_device_;
   }
 };
+
+using MemoryIo = Memory<std::istream, std::ostream, std::ostream>;
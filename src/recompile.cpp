@@ -0,0 +1,278 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "aot.h"
+#include "instruction.h"
+#include "memory.h"
+#include "rom.h"
+#include "types.h"
+
+/*
+ * Translates a .slug ROM into C++ that implements the same program against
+ * AotState. Build the output into a shared object next to the ROM, e.g.
+ *
+ *   ./recompile games/snake.slug snake.cpp
+ *   c++ -O2 -shared -fPIC -I src snake.cpp -o games/snake.so
+ *
+ * and unengine picks it up when it runs games/snake.slug.
+ */
+
+constexpr address_t RAM_END = AddressSpace::RamStart + AddressSpace::RamSize;
+
+static DecodedInstruction decode_at(const Rom &r, address_t pc) {
+  return Instruction{r.read32(pc - AddressSpace::RomStart)}.predecode();
+}
+
+static bool in_rom(std::uint32_t pc) {
+  return pc >= AddressSpace::RomStart && pc < MEMORY_SIZE &&
+         pc % sizeof(instruction_t) == 0;
+}
+
+/*
+ * walks the control flow from the setup and loop entry points. return
+ * addresses of JALs are followed too, since that is where JR usually goes;
+ * any other JR target is left to the interpreter.
+ */
+static std::vector<bool> find_reachable(const Rom &r) {
+  std::vector<bool> reachable(ROM_INSTRUCTION_COUNT);
+  std::vector<std::uint32_t> work = {r.slug_setup_, r.slug_loop_};
+
+  while (!work.empty()) {
+    std::uint32_t pc = work.back();
+    work.pop_back();
+    if (!in_rom(pc)) continue;
+
+    size_t index = (pc - AddressSpace::RomStart) / sizeof(instruction_t);
+    if (reachable[index]) continue;
+    reachable[index] = true;
+
+    DecodedInstruction d = decode_at(r, pc);
+    address_t next = pc + sizeof(instruction_t);
+    switch (d.operation) {
+      case Operation::BEQ:
+      case Operation::BNE:
+        work.push_back(next);
+        work.push_back(static_cast<address_t>(next + d.immediate * 4));
+        break;
+      case Operation::J:
+        work.push_back(static_cast<address_t>(d.immediate * 4));
+        break;
+      case Operation::JAL:
+        work.push_back(static_cast<address_t>(d.immediate * 4));
+        work.push_back(next);
+        break;
+      case Operation::JR:
+        break;
+      default:
+        work.push_back(next);
+        break;
+    }
+  }
+
+  return reachable;
+}
+
+static std::string reg(register_index_t r) {
+  if (r == 0) return "0";
+  return "r[" + std::to_string(r) + "]";
+}
+
+static std::string label(address_t pc) {
+  char buffer[16];
+  std::snprintf(buffer, sizeof(buffer), "L_%04x", pc);
+  return buffer;
+}
+
+// ends the translated path: continue at a known label or leave it to the
+// interpreter
+// every loop jumps back somewhere, so that is where the budget is checked
+static std::string go(const std::vector<bool> &reachable, address_t pc,
+                      address_t target) {
+  std::string leave =
+      "{ s->program_counter = " + std::to_string(target) + "; return; }";
+  if (!in_rom(target) ||
+      !reachable[(target - AddressSpace::RomStart) / sizeof(instruction_t)]) {
+    return leave;
+  }
+  if (target > pc) return "goto " + label(target) + ";";
+  return "{ if (s->instruction_count >= s->instruction_limit) " + leave +
+         " goto " + label(target) + "; }";
+}
+
+// leaves the program for the interpreter unless the address is in RAM
+static void emit_effective_address(std::ostream &out,
+                                   const DecodedInstruction &d, address_t pc) {
+  out << "  ea = " << reg(d.reg_a) << " + " << d.immediate << ";\n"
+      << "  if (ea >= " << RAM_END << ") { s->program_counter = " << pc
+      << "; return; }\n";
+}
+
+// writes to r0 are dropped (RAM loads have no side effects either)
+static void assign(std::ostream &out, register_index_t r,
+                   const std::string &value) {
+  if (r != 0) out << "  " << reg(r) << " = " << value << ";\n";
+}
+
+static void emit_instruction(std::ostream &out,
+                             const std::vector<bool> &reachable,
+                             const DecodedInstruction &d, address_t pc) {
+  address_t next = pc + sizeof(instruction_t);
+  std::string a = reg(d.reg_a), b = reg(d.reg_b);
+  std::string imm = std::to_string(d.immediate);
+  std::string shift = std::to_string(d.shift_value);
+
+  out << label(pc) << ":\n";
+
+  switch (d.operation) {
+    case Operation::INVALID:
+      out << "  s->program_counter = " << pc << ";\n  return;\n";
+      return;
+    case Operation::SB:
+    case Operation::LBU:
+    case Operation::LW:
+    case Operation::SW:
+      emit_effective_address(out, d, pc);
+      break;
+    default:
+      break;
+  }
+  out << "  s->instruction_count++;\n";
+
+  switch (d.operation) {
+    case Operation::ORI:
+      assign(out, d.reg_b, a + " | " + imm);
+      break;
+    case Operation::ADDI:
+      assign(out, d.reg_b, a + " + " + imm);
+      break;
+    case Operation::BEQ:
+    case Operation::BNE:
+      out << "  if (" << a << (d.operation == Operation::BEQ ? " == " : " != ")
+          << b << ") "
+          << go(reachable, pc, static_cast<address_t>(next + d.immediate * 4))
+          << "\n";
+      break;
+    case Operation::SB:
+      out << "  m[ea] = " << b << " & 0xFF;\n"
+          << "  d[ea / " << PAGE_SIZE << "] = " << int{PAGE_WRITTEN}
+          << ";\n";
+      break;
+    case Operation::LBU:
+      assign(out, d.reg_b, "m[ea]");
+      break;
+    case Operation::JAL:
+      out << "  r[31] = " << next << ";\n  "
+          << go(reachable, pc, static_cast<address_t>(d.immediate * 4))
+          << "\n";
+      return;
+    case Operation::LW:
+      // words are stored big-endian at the even address
+      out << "  ea &= 0xFFFE;\n";
+      assign(out, d.reg_b, "m[ea] << 8 | m[ea + 1]");
+      break;
+    case Operation::SW:
+      out << "  ea &= 0xFFFE;\n"
+          << "  m[ea] = " << b << " >> 8;\n"
+          << "  m[ea + 1] = " << b << " & 0xFF;\n"
+          << "  d[ea / " << PAGE_SIZE << "] = " << int{PAGE_WRITTEN}
+          << ";\n";
+      break;
+    case Operation::J:
+      out << "  " << go(reachable, pc, static_cast<address_t>(d.immediate * 4))
+          << "\n";
+      return;
+    case Operation::NOR:
+      assign(out, d.reg_c, "~(" + a + " | " + b + ")");
+      break;
+    case Operation::SLT:
+      // ISA expects these to be signed values
+      assign(out, d.reg_c, "(std::int16_t)" + a + " < (std::int16_t)" + b);
+      break;
+    case Operation::SLL:
+      assign(out, d.reg_c, "(std::uint32_t)" + b + " << " + shift);
+      break;
+    case Operation::SRA:
+      assign(out, d.reg_c, "(std::int16_t)" + b + " >> " + shift);
+      break;
+    case Operation::JR:
+      out << "  s->program_counter = " << a << ";\n"
+          << "  if (s->instruction_count >= s->instruction_limit) return;\n"
+          << "  goto dispatch;\n";
+      return;
+    case Operation::SRL:
+      assign(out, d.reg_c, b + " >> " + shift);
+      break;
+    case Operation::OR:
+      assign(out, d.reg_c, a + " | " + b);
+      break;
+    case Operation::SUB:
+      assign(out, d.reg_c, a + " - " + b);
+      break;
+    case Operation::ADD:
+      assign(out, d.reg_c, a + " + " + b);
+      break;
+    case Operation::AND:
+      assign(out, d.reg_c, a + " & " + b);
+      break;
+    default:
+      break;
+  }
+
+  // falling off the end of the address space returns to 0
+  if (next == 0) out << "  s->program_counter = 0;\n  return;\n";
+}
+
+void recompile(const Rom &r, const std::string &source, std::ostream &out) {
+  std::vector<bool> reachable = find_reachable(r);
+
+  out << "// generated by recompile from " << source << "; do not edit\n"
+      << "#include \"aot.h\"\n\n"
+      << "extern \"C\" {\n"
+      << "extern const int " << AOT_ABI_VERSION_SYMBOL << " = "
+      << AOT_ABI_VERSION << ";\n"
+      << "extern const std::uint64_t " << AOT_ROM_HASH_SYMBOL << " = "
+      << r.hash() << "ull;\n\n"
+      << "void " << AOT_RUN_SYMBOL << "(AotState *s) {\n"
+      << "  register_value_t *r = s->registers;\n"
+      << "  byte_t *m = s->memory;\n"
+      << "  byte_t *d = s->dirty_pages;\n"
+      << "  address_t ea;\n\n"
+      << "dispatch:\n"
+      << "  switch (s->program_counter) {\n";
+
+  for (size_t i = 0; i < ROM_INSTRUCTION_COUNT; i++) {
+    if (!reachable[i]) continue;
+    address_t pc = AddressSpace::RomStart + i * sizeof(instruction_t);
+    out << "    case " << pc << ": goto " << label(pc) << ";\n";
+  }
+  out << "    default: return;\n  }\n\n";
+
+  for (size_t i = 0; i < ROM_INSTRUCTION_COUNT; i++) {
+    if (!reachable[i]) continue;
+    address_t pc = AddressSpace::RomStart + i * sizeof(instruction_t);
+    emit_instruction(out, reachable, decode_at(r, pc), pc);
+  }
+
+  out << "}\n}\n";
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    std::cerr << "usage: " << argv[0] << " <rom file> <output .cpp file>."
+              << std::endl;
+    return 1;
+  }
+
+  Rom r = Rom::ReadRomFile(argv[1]);
+  std::ofstream out(argv[2]);
+  if (!out.is_open()) {
+    std::cerr << "Error opening file: " << argv[2] << std::endl;
+    return 1;
+  }
+
+  recompile(r, argv[1], out);
+  return 0;
+}
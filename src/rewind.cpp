@@ -0,0 +1,284 @@
+#include "rewind.h"
+
+#include <cstring>
+
+namespace {
+
+constexpr size_t REGISTER_COUNT = 32;
+constexpr size_t CHUNK_SIZE = sizeof(std::uint64_t);
+constexpr size_t RAM_PAGE_COUNT = AddressSpace::RamSize / PAGE_SIZE;
+
+// a state is RAM, then the registers and PC, padded to whole chunks
+constexpr size_t REGISTERS_OFFSET = AddressSpace::RamSize;
+constexpr size_t PROGRAM_COUNTER_OFFSET =
+    REGISTERS_OFFSET + REGISTER_COUNT * sizeof(register_value_t);
+constexpr size_t STATE_SIZE =
+    (PROGRAM_COUNTER_OFFSET + sizeof(register_value_t) + CHUNK_SIZE - 1) /
+    CHUNK_SIZE * CHUNK_SIZE;
+constexpr size_t STATE_CHUNKS = STATE_SIZE / CHUNK_SIZE;
+constexpr size_t TAIL_SIZE = STATE_SIZE - REGISTERS_OFFSET;
+
+// a delta is a list of records: skip some chunks, then XOR `count` chunks
+struct Record {
+  std::uint16_t skip;
+  std::uint16_t count;
+};
+static_assert(STATE_CHUNKS <= UINT16_MAX, "chunk counts must fit a Record");
+
+// the worst case is every other chunk changing
+constexpr size_t MAX_DELTA_SIZE =
+    (STATE_CHUNKS + 1) / 2 * (sizeof(Record) + CHUNK_SIZE);
+
+constexpr size_t NO_ROOM = SIZE_MAX;
+
+std::uint64_t load_chunk(const byte_t *p) {
+  std::uint64_t chunk;
+  std::memcpy(&chunk, p, CHUNK_SIZE);
+  return chunk;
+}
+
+void store_chunk(byte_t *p, std::uint64_t chunk) {
+  std::memcpy(p, &chunk, CHUNK_SIZE);
+}
+
+// encodes the changed chunks of a state, which must come in order
+class DeltaWriter {
+ private:
+  byte_t *out_;
+  size_t size_;
+  // chunk after the last one written
+  size_t next_;
+  // the record being extended, if any, starts at out_ + record_
+  bool open_;
+  size_t record_;
+  Record header_;
+
+  void close() {
+    if (open_) std::memcpy(out_ + record_, &header_, sizeof(header_));
+    open_ = false;
+  }
+
+ public:
+  explicit DeltaWriter(byte_t *out)
+      : out_(out), size_(0), next_(0), open_(false) {}
+
+  void write(size_t index, std::uint64_t difference) {
+    if (open_ && index == next_) {
+      header_.count++;
+    } else {
+      close();
+      open_ = true;
+      record_ = size_;
+      header_ = Record{static_cast<std::uint16_t>(index - next_), 1};
+      size_ += sizeof(Record);
+    }
+    store_chunk(out_ + size_, difference);
+    size_ += CHUNK_SIZE;
+    next_ = index + 1;
+  }
+
+  size_t finish() {
+    close();
+    return size_;
+  }
+};
+
+}  // namespace
+
+RewindBuffer::RewindBuffer(size_t arena_size)
+    : arena_(arena_size),
+      head_(0),
+      used_(0),
+      latest_(STATE_SIZE),
+      latest_frame_(0),
+      empty_(true),
+      encoded_(MAX_DELTA_SIZE) {}
+
+void RewindBuffer::clear() {
+  deltas_.clear();
+  head_ = 0;
+  used_ = 0;
+  latest_frame_ = 0;
+  empty_ = true;
+}
+
+/*
+ * finds room for `size` bytes after the newest delta, dropping the oldest
+ * ones until there is. deltas don't wrap around the end of the arena; the
+ * space left there stays unused until the deltas before it are dropped.
+ */
+size_t RewindBuffer::allocate(size_t size) {
+  if (size > arena_.size()) {
+    deltas_.clear();
+    head_ = 0;
+    used_ = 0;
+    return NO_ROOM;
+  }
+
+  for (;;) {
+    if (deltas_.empty()) {
+      head_ = 0;
+      return 0;
+    }
+
+    // head_ == tail means the arena is full, unless every delta is empty
+    size_t tail = deltas_.front().offset;
+    if (head_ > tail || (head_ == tail && used_ == 0)) {
+      // free: head_ to the end, and the start to tail
+      if (arena_.size() - head_ >= size) return head_;
+      if (tail >= size) return 0;
+    } else if (head_ < tail && tail - head_ >= size) {
+      return head_;
+    }
+    used_ -= deltas_.front().size;
+    deltas_.pop_front();
+  }
+}
+
+void RewindBuffer::capture(std::uint64_t frame,
+                           const register_value_t *registers,
+                           register_value_t program_counter,
+                           MemoryIo &memory) {
+  const byte_t *ram = memory.get_memory_buffer() + AddressSpace::RamStart;
+  byte_t tail[TAIL_SIZE] = {};
+  std::memcpy(tail, registers, REGISTER_COUNT * sizeof(register_value_t));
+  std::memcpy(tail + PROGRAM_COUNTER_OFFSET - REGISTERS_OFFSET,
+              &program_counter, sizeof(program_counter));
+
+  if (empty_) {
+    std::memcpy(latest_.data(), ram, AddressSpace::RamSize);
+    std::memcpy(latest_.data() + REGISTERS_OFFSET, tail, TAIL_SIZE);
+    empty_ = false;
+  } else {
+    // turns latest_ into the new state, noting what that changed
+    DeltaWriter writer(encoded_.data());
+    auto compare = [&](const byte_t *current, size_t offset, size_t size) {
+      for (size_t i = 0; i < size; i += CHUNK_SIZE) {
+        byte_t *old = latest_.data() + offset + i;
+        std::uint64_t chunk = load_chunk(current + i);
+        std::uint64_t difference = chunk ^ load_chunk(old);
+        if (difference == 0) continue;
+        writer.write((offset + i) / CHUNK_SIZE, difference);
+        store_chunk(old, chunk);
+      }
+    };
+    for (size_t p = 0; p < RAM_PAGE_COUNT; p++) {
+      if (!memory.page_dirty(p, DirtyTracker::Rewind)) continue;
+      compare(ram + p * PAGE_SIZE, p * PAGE_SIZE, PAGE_SIZE);
+    }
+    compare(tail, REGISTERS_OFFSET, TAIL_SIZE);
+
+    size_t size = writer.finish();
+    size_t offset = allocate(size);
+    if (offset != NO_ROOM) {
+      std::memcpy(arena_.data() + offset, encoded_.data(), size);
+      deltas_.push_back(Delta{offset, size, latest_frame_});
+      head_ = offset + size;
+      used_ += size;
+    }
+  }
+
+  latest_frame_ = frame;
+  memory.clear_dirty_pages(DirtyTracker::Rewind);
+}
+
+// turns latest_ into the state before it
+void RewindBuffer::undo(const Delta &delta, bool *touched_pages) {
+  const byte_t *in = arena_.data() + delta.offset;
+  const byte_t *end = in + delta.size;
+  size_t offset = 0;
+  while (in < end) {
+    Record record;
+    std::memcpy(&record, in, sizeof(record));
+    in += sizeof(record);
+    offset += record.skip * CHUNK_SIZE;
+    for (size_t i = 0; i < record.count; i++) {
+      byte_t *old = latest_.data() + offset;
+      store_chunk(old, load_chunk(old) ^ load_chunk(in));
+      if (offset < AddressSpace::RamSize) {
+        touched_pages[offset / PAGE_SIZE] = true;
+      }
+      in += CHUNK_SIZE;
+      offset += CHUNK_SIZE;
+    }
+  }
+}
+
+std::uint64_t RewindBuffer::restore(std::uint64_t frame,
+                                    register_value_t *registers,
+                                    register_value_t &program_counter,
+                                    MemoryIo &memory) {
+  bool touched_pages[RAM_PAGE_COUNT] = {};
+  while (latest_frame_ > frame && !deltas_.empty()) {
+    const Delta &delta = deltas_.back();
+    undo(delta, touched_pages);
+    latest_frame_ = delta.frame;
+    head_ = delta.offset;
+    used_ -= delta.size;
+    deltas_.pop_back();
+  }
+
+  // RAM differs from latest_ where either side changed since the capture
+  byte_t *ram = memory.get_memory_buffer() + AddressSpace::RamStart;
+  for (size_t p = 0; p < RAM_PAGE_COUNT; p++) {
+    if (!touched_pages[p] && !memory.page_dirty(p, DirtyTracker::Rewind)) {
+      continue;
+    }
+    std::memcpy(ram + p * PAGE_SIZE, latest_.data() + p * PAGE_SIZE,
+                PAGE_SIZE);
+    memory.mark_page_dirty(p);
+  }
+  memory.clear_dirty_pages(DirtyTracker::Rewind);
+
+  std::memcpy(registers, latest_.data() + REGISTERS_OFFSET,
+              REGISTER_COUNT * sizeof(register_value_t));
+  std::memcpy(&program_counter, latest_.data() + PROGRAM_COUNTER_OFFSET,
+              sizeof(program_counter));
+  return latest_frame_;
+}
+
+RewindBuffer::Stats RewindBuffer::get_stats() const {
+  Stats stats{};
+  stats.reserved_bytes = arena_.size() + latest_.size() + encoded_.size();
+  stats.used_bytes = used_;
+  stats.states = empty_ ? 0 : deltas_.size() + 1;
+  stats.oldest_frame = deltas_.empty() ? latest_frame_ : deltas_.front().frame;
+  return stats;
+}
+
+Checkpoint::Checkpoint(DirtyTracker tracker)
+    : tracker_(tracker), registers_{}, program_counter_(0) {}
+
+void Checkpoint::save(const register_value_t *registers,
+                      register_value_t program_counter, MemoryIo &memory) {
+  const byte_t *ram = memory.get_memory_buffer() + AddressSpace::RamStart;
+  if (ram_.empty()) {
+    ram_.assign(ram, ram + AddressSpace::RamSize);
+  } else {
+    for (size_t p = 0; p < RAM_PAGE_COUNT; p++) {
+      if (!memory.page_dirty(p, tracker_)) continue;
+      std::memcpy(ram_.data() + p * PAGE_SIZE, ram + p * PAGE_SIZE,
+                  PAGE_SIZE);
+    }
+  }
+  memory.clear_dirty_pages(tracker_);
+  std::memcpy(registers_, registers, sizeof(registers_));
+  program_counter_ = program_counter;
+}
+
+// putting a page back is a write like any other, so the pages are marked
+// for the other trackers again: one that saved since the writes being
+// undone has already cleared its bit for them
+void Checkpoint::restore(register_value_t *registers,
+                         register_value_t &program_counter,
+                         MemoryIo &memory) {
+  byte_t *ram = memory.get_memory_buffer() + AddressSpace::RamStart;
+  for (size_t p = 0; p < RAM_PAGE_COUNT; p++) {
+    if (!memory.page_dirty(p, tracker_)) continue;
+    std::memcpy(ram + p * PAGE_SIZE, ram_.data() + p * PAGE_SIZE, PAGE_SIZE);
+    memory.mark_page_dirty(p);
+  }
+  memory.clear_dirty_pages(tracker_);
+  std::memcpy(registers, registers_, sizeof(registers_));
+  program_counter = program_counter_;
+}
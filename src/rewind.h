@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "memory.h"
+#include "types.h"
+
+/*
+ * The last few seconds of an emulator's states, in an arena of fixed size.
+ * A state is RAM followed by the registers and PC. Only the newest state is
+ * kept in full; each older one is a delta that turns its successor back into
+ * it: the XOR of the two, with runs of all-zero 8-byte chunks left out. Once
+ * the arena is full, the oldest deltas make room for new ones.
+ *
+ * Capturing only compares the RAM pages marked for DirtyTracker::Rewind.
+ */
+class RewindBuffer {
+ public:
+  struct Stats {
+    // allocated up front and never more: the arena, the newest state and
+    // room to encode one delta
+    size_t reserved_bytes;
+    // arena bytes holding deltas
+    size_t used_bytes;
+    // states that can be restored, and the frame of the oldest one
+    size_t states;
+    std::uint64_t oldest_frame;
+  };
+
+ private:
+  struct Delta {
+    size_t offset;
+    size_t size;
+    // frame of the state it restores
+    std::uint64_t frame;
+  };
+
+  std::vector<byte_t> arena_;
+  // oldest first; they sit in the arena in this order, wrapping at its end
+  std::deque<Delta> deltas_;
+  // where the next delta goes, and the bytes the deltas take up
+  size_t head_;
+  size_t used_;
+  std::vector<byte_t> latest_;
+  std::uint64_t latest_frame_;
+  bool empty_;
+  std::vector<byte_t> encoded_;
+
+  size_t allocate(size_t size);
+  void undo(const Delta &delta, bool *touched_pages);
+
+ public:
+  explicit RewindBuffer(size_t arena_size);
+  RewindBuffer(const RewindBuffer &) = delete;
+  RewindBuffer &operator=(const RewindBuffer &) = delete;
+
+  bool empty() const { return empty_; }
+  void clear();
+  // makes the given state the newest one, frame being its frame number
+  void capture(std::uint64_t frame, const register_value_t *registers,
+               register_value_t program_counter, MemoryIo &memory);
+  /*
+   * goes back to the newest state at or before `frame`, or to the oldest
+   * one kept, and returns its frame. states after it are dropped. must not
+   * be called while empty().
+   */
+  std::uint64_t restore(std::uint64_t frame, register_value_t *registers,
+                        register_value_t &program_counter, MemoryIo &memory);
+  Stats get_stats() const;
+};
+
+/*
+ * One state to go back to: RAM, the registers and PC. Saving again only
+ * copies the RAM pages marked for its DirtyTracker since the last save, and
+ * restoring only those written since.
+ */
+class Checkpoint {
+ private:
+  DirtyTracker tracker_;
+  // empty until the first save
+  std::vector<byte_t> ram_;
+  register_value_t registers_[32];
+  register_value_t program_counter_;
+
+ public:
+  explicit Checkpoint(DirtyTracker tracker);
+
+  void save(const register_value_t *registers,
+            register_value_t program_counter, MemoryIo &memory);
+  // must not be called before save()
+  void restore(register_value_t *registers, register_value_t &program_counter,
+               MemoryIo &memory);
+};
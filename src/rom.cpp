@@ -15,6 +15,17 @@ Rom::Rom(std::shared_ptr<byte_t[]> contents)
       slug_program_data_address_(this->read32(SLUGAddressSpecifier::PDA_RAM)),
       slug_size_(this->read32(SLUGAddressSpecifier::DATA_SIZE)) {}
 
+std::uint64_t Rom::hash() const { return rom_hash(contents_.get()); }
+
+std::uint64_t fnv1a(std::uint64_t hash, const byte_t* data, size_t size) {
+  for (size_t i = 0; i < size; i++) hash = (hash ^ data[i]) * 0x100000001b3;
+  return hash;
+}
+
+std::uint64_t rom_hash(const byte_t* contents) {
+  return fnv1a(FNV1A_BASIS, contents, SLUGValues::FILE_SIZE);
+}
+
 Rom Rom::ReadRomFile(const std::string& filename) {
   // allocate memmory where the slug file contents will be stored
   std::shared_ptr<byte_t[]> slug_contents(new byte_t[SLUGValues::FILE_SIZE]);
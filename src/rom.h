@@ -43,5 +43,17 @@ class Rom {
         contents_.get())[addr / sizeof(uint32_t)]);
   }
 
+  // identifies the ROM image, e.g. to match it with recompiled code
+  std::uint64_t hash() const;
+
   static Rom ReadRomFile(const std::string& filename);
 };
+
+// FNV-1a hash of no bytes, to start from
+constexpr std::uint64_t FNV1A_BASIS = 0xcbf29ce484222325;
+
+// carries the FNV-1a hash on over size more bytes
+std::uint64_t fnv1a(std::uint64_t hash, const byte_t* data, size_t size);
+
+// FNV-1a hash of a FILE_SIZE byte ROM image
+std::uint64_t rom_hash(const byte_t* contents);
@@ -0,0 +1,156 @@
+#include "savestate.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "rom.h"
+
+static std::uint64_t checksum(const byte_t *image) {
+  constexpr size_t FIELD = offsetof(SaveStateHeader, checksum);
+  constexpr byte_t ZERO[sizeof(std::uint64_t)] = {};
+  std::uint64_t hash = fnv1a(FNV1A_BASIS, image, FIELD);
+  hash = fnv1a(hash, ZERO, sizeof(ZERO));
+  constexpr size_t REST = FIELD + sizeof(ZERO);
+  return fnv1a(hash, image + REST, SAVE_STATE_SIZE - REST);
+}
+
+// the first problem with the image, or nullptr if it's fine
+static const char *check(const byte_t *image) {
+  const auto &header = *reinterpret_cast<const SaveStateHeader *>(image);
+  const byte_t *memory = image + SAVE_STATE_MEMORY_OFFSET;
+  if (std::memcmp(header.magic, SAVE_STATE_MAGIC, sizeof(header.magic)) != 0) {
+    return "not a save state";
+  }
+  if (header.version != SAVE_STATE_VERSION) return "unsupported version";
+  if (header.byte_order != SAVE_STATE_BYTE_ORDER) {
+    return "saved on a host of another byte order";
+  }
+  if (header.checksum != checksum(image) ||
+      header.rom_hash != rom_hash(memory + AddressSpace::RomStart)) {
+    return "checksum mismatch";
+  }
+  return nullptr;
+}
+
+SaveStateFile::SaveStateFile(const std::string &filename) : data_(nullptr) {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "Error opening file for loading state." << std::endl;
+    return;
+  }
+
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size == SAVE_STATE_SIZE) {
+    data = mmap(nullptr, SAVE_STATE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Error loading state: " << filename
+              << " is not a save state." << std::endl;
+    return;
+  }
+
+  const char *problem = check(static_cast<const byte_t *>(data));
+  if (problem != nullptr) {
+    std::cerr << "Error loading state: " << filename << ": " << problem << "."
+              << std::endl;
+    munmap(data, SAVE_STATE_SIZE);
+    return;
+  }
+  data_ = data;
+}
+
+SaveStateFile::~SaveStateFile() {
+  if (data_ != nullptr) munmap(data_, SAVE_STATE_SIZE);
+}
+
+SaveStateWriter::SaveStateWriter()
+    : writing_(false), failed_(false), stopping_(false) {
+  thread_ = std::thread(&SaveStateWriter::run, this);
+}
+
+// whatever is still queued is written first
+SaveStateWriter::~SaveStateWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queued_.notify_one();
+  thread_.join();
+}
+
+SaveStateWriter &SaveStateWriter::Get() {
+  static SaveStateWriter writer;
+  return writer;
+}
+
+void SaveStateWriter::write(const std::string &filename,
+                            std::vector<byte_t> image) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool replaced = false;
+    for (Job &job : queue_) {
+      if (job.filename == filename) {
+        job.image = std::move(image);
+        replaced = true;
+        break;
+      }
+    }
+    if (!replaced) queue_.push_back(Job{filename, std::move(image)});
+  }
+  queued_.notify_one();
+}
+
+bool SaveStateWriter::flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this]() { return queue_.empty() && !writing_; });
+  bool ok = !failed_;
+  failed_ = false;
+  return ok;
+}
+
+static bool write_image(const std::string &filename,
+                        std::vector<byte_t> &image) {
+  auto &header = *reinterpret_cast<SaveStateHeader *>(image.data());
+  const byte_t *memory = image.data() + SAVE_STATE_MEMORY_OFFSET;
+  header.rom_hash = rom_hash(memory + AddressSpace::RomStart);
+  header.checksum = checksum(image.data());
+
+  std::string temporary = filename + ".tmp";
+  std::ofstream file(temporary, std::ios::binary);
+  file.write(reinterpret_cast<const char *>(image.data()), image.size());
+  file.close();
+  if (!file || std::rename(temporary.c_str(), filename.c_str()) != 0) {
+    std::cerr << "Error saving state to " << filename << "." << std::endl;
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+void SaveStateWriter::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    queued_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) return;
+
+    Job job = std::move(queue_.front());
+    queue_.pop_front();
+    writing_ = true;
+    lock.unlock();
+    bool ok = write_image(job.filename, job.image);
+    lock.lock();
+    writing_ = false;
+    failed_ |= !ok;
+    done_.notify_all();
+  }
+}
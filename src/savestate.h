@@ -0,0 +1,108 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "memory.h"
+#include "types.h"
+
+/*
+ * Save state files: a SaveStateHeader, then the whole address space at
+ * SAVE_STATE_MEMORY_OFFSET. Fields are in the byte order of the host that
+ * saved them, so a file is read by mapping it and looking at it in place;
+ * hosts of the other byte order refuse it.
+ */
+constexpr char SAVE_STATE_MAGIC[8] = {'U', 'N', 'E', 'N',
+                                      'G', 'S', 'T', '\0'};
+// bump whenever the layout changes
+constexpr std::uint32_t SAVE_STATE_VERSION = 1;
+constexpr std::uint32_t SAVE_STATE_BYTE_ORDER = 0x01020304;
+// page aligned, so the memory can be mapped on its own
+constexpr size_t SAVE_STATE_MEMORY_OFFSET = 0x1000;
+constexpr size_t SAVE_STATE_SIZE = SAVE_STATE_MEMORY_OFFSET + MEMORY_SIZE;
+
+struct SaveStateHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  // FNV-1a of the whole file, taken with this field zero
+  std::uint64_t checksum;
+  // Rom::hash() of the ROM region of the saved memory
+  std::uint64_t rom_hash;
+  std::uint64_t frame_count;
+  register_value_t program_counter;
+  address_t loop_address;
+  register_value_t registers[32];
+};
+
+static_assert(sizeof(SaveStateHeader) <= SAVE_STATE_MEMORY_OFFSET,
+              "the header must end before the memory");
+
+// A save state file mapped read-only, checked before anything looks at it.
+class SaveStateFile {
+ private:
+  void *data_;
+
+ public:
+  // prints why and leaves valid() false if the file can't be mapped, or
+  // isn't an intact save state of this version and byte order
+  explicit SaveStateFile(const std::string &filename);
+  ~SaveStateFile();
+  SaveStateFile(const SaveStateFile &) = delete;
+  SaveStateFile &operator=(const SaveStateFile &) = delete;
+
+  bool valid() const { return data_ != nullptr; }
+  const SaveStateHeader &header() const {
+    return *static_cast<const SaveStateHeader *>(data_);
+  }
+  const byte_t *memory() const {
+    return static_cast<const byte_t *>(data_) + SAVE_STATE_MEMORY_OFFSET;
+  }
+};
+
+/*
+ * Writes save states on a background thread, so that saving never waits on
+ * the disk. The checksum and ROM hash are filled in there too. Each file is
+ * written under a temporary name and renamed over the old one once it is
+ * complete; a newer save to a file still waiting in the queue replaces the
+ * older one.
+ */
+class SaveStateWriter {
+ private:
+  struct Job {
+    std::string filename;
+    std::vector<byte_t> image;
+  };
+
+  std::mutex mutex_;
+  std::condition_variable queued_;
+  std::condition_variable done_;
+  std::deque<Job> queue_;
+  bool writing_;
+  bool failed_;
+  bool stopping_;
+  std::thread thread_;
+
+  SaveStateWriter();
+  void run();
+
+ public:
+  ~SaveStateWriter();
+  SaveStateWriter(const SaveStateWriter &) = delete;
+  SaveStateWriter &operator=(const SaveStateWriter &) = delete;
+
+  // the writer all Emulators share
+  static SaveStateWriter &Get();
+
+  // image is SAVE_STATE_SIZE bytes with everything but the hashes filled in
+  void write(const std::string &filename, std::vector<byte_t> image);
+  // waits until everything queued so far is written. returns false if any
+  // write failed since the last call
+  bool flush();
+};
@@ -0,0 +1,62 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+FrameScheduler::FrameScheduler(std::chrono::nanoseconds period, double speed)
+    : period_(period),
+      speed_(speed),
+      start_(Clock::now()),
+      frames_since_start_(0),
+      stats_(),
+      total_jitter_us_(0),
+      stopped_(false) {}
+
+void FrameScheduler::set_speed(double speed) {
+  speed_ = speed;
+  start_ = Clock::now();
+  frames_since_start_ = 0;
+}
+
+void FrameScheduler::wait() {
+  stats_.frames++;
+  if (speed_ <= 0) return;
+
+  frames_since_start_++;
+  Clock::time_point deadline =
+      start_ + std::chrono::duration_cast<Clock::duration>(
+                   period_ * (frames_since_start_ / speed_));
+  {
+    // waiting until an absolute time rather than for a while can't oversleep
+    // by however long it took to start
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto stopped = [&]() { return stopped_; };
+    if (stopped_changed_.wait_until(lock, deadline, stopped)) return;
+  }
+
+  Clock::time_point now = Clock::now();
+  std::chrono::duration<double, std::micro> jitter = now - deadline;
+  total_jitter_us_ += jitter.count();
+  stats_.paced_frames++;
+  stats_.max_jitter_us = std::max(stats_.max_jitter_us, jitter.count());
+  if (jitter >= period_ / speed_) {
+    stats_.late_frames++;
+    start_ = now;
+    frames_since_start_ = 0;
+  }
+}
+
+void FrameScheduler::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  stopped_changed_.notify_all();
+}
+
+FrameScheduler::Stats FrameScheduler::get_stats() const {
+  Stats stats = stats_;
+  if (stats.paced_frames > 0) {
+    stats.mean_jitter_us = total_jitter_us_ / stats.paced_frames;
+  }
+  return stats;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/*
+ * Paces frames against absolute deadlines: frame n of a run is due n
+ * periods after it started, so waking up late delays that one frame and
+ * not every frame after it. The speed scales the rate, for slow motion
+ * below 1 and turbo above it; at 0 frames aren't paced at all. A frame that
+ * starts more than a period late starts the schedule over rather than
+ * rushing the frames after it to catch up.
+ *
+ * stop() may be called from another thread, to cut short a wait that a slow
+ * speed would make long.
+ */
+class FrameScheduler {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Stats {
+    std::uint64_t frames;
+    // those not run uncapped, and of them, those that started a whole period
+    // or more late
+    std::uint64_t paced_frames;
+    std::uint64_t late_frames;
+    // how long after their deadlines paced frames started, in microseconds
+    double mean_jitter_us;
+    double max_jitter_us;
+  };
+
+ private:
+  std::chrono::duration<double, std::nano> period_;
+  double speed_;
+  // the time the run started, and the frames waited for since
+  Clock::time_point start_;
+  std::uint64_t frames_since_start_;
+  Stats stats_;
+  double total_jitter_us_;
+  // set by stop(), which notifies stopped_changed_
+  std::mutex mutex_;
+  std::condition_variable stopped_changed_;
+  bool stopped_;
+
+ public:
+  // period is a frame's length at 1x
+  FrameScheduler(std::chrono::nanoseconds period, double speed);
+
+  // starts a run at the new speed
+  void set_speed(double speed);
+  double get_speed() const { return speed_; }
+  // waits for the next frame's deadline, or until stop() is called
+  void wait();
+  // ends any wait under way, and makes waits from now on return at once
+  void stop();
+  Stats get_stats() const;
+};
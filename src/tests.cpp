@@ -1,23 +1,44 @@
 #include <gtest/gtest.h>
+#include <sys/resource.h>
 
+#include <algorithm>
+#include <cstdlib>
+#include <bitset>
+#include <fstream>
+#include <iterator>
+#include <memory>
 #include <sstream>
+#include <thread>
+#include <vector>
 
+#include "blit.h"
 #include "controller.h"
 #include "emulator.h"
+#include "handoff.h"
 #include "instruction.h"
 #include "instruction_data.h"
+#include "lockstep.h"
 #include "memory.h"
 #include "rom.h"
+#include "savestate.h"
+#include "scheduler.h"
 #include "types.h"
 
 TEST(RegisterTests, BasicFunctionality) {
-  Register zero(true), writable(static_cast<register_value_t>(0));
+  Emulator emu;
+
+  emu.set_register_value(0, 5);
+  emu.set_register_value(1, 5);
 
-  zero = 5;
-  writable = 5;
+  ASSERT_EQ(emu.get_register_value(0), 0)
+      << "Zero register should not be mutable.";
+  ASSERT_EQ(emu.get_register_value(1), 5)
+      << "Writable register should be mutable.";
 
-  ASSERT_EQ(*zero, 0) << "Zero register should not be mutable.";
-  ASSERT_EQ(*writable, 5) << "Writable register should be mutable.";
+  // ADDI r0, r1, 7
+  emu.execute_decoded({Operation::ADDI, 1, 0, 0, 0, 7});
+  ASSERT_EQ(emu.get_register_value(0), 0)
+      << "Instructions should not write the zero register.";
 }
 
 TEST(MemoryTests, Memory) {
@@ -25,11 +46,7 @@ TEST(MemoryTests, Memory) {
   std::ostringstream out, err;
   ControllerState cont;
 
-  bool stopped = false;
-  bool *p = &stopped;
-
-  Memory<typeof(in), typeof(out), typeof(err)> mem(in, out, err, cont,
-                                                   [p]() { *p = true; });
+  Memory<typeof(in), typeof(out), typeof(err)> mem(in, out, err, cont);
 
   // this takes a BE number.
   mem.write_word(0x4000, htons(0x5678));
@@ -38,11 +55,12 @@ TEST(MemoryTests, Memory) {
 
   mem.write_byte(0x7110, 'O');
   mem.write_byte(0x7120, 'E');
+  ASSERT_EQ(mem.halted(), false);
   mem.write_byte(0x7200, 'S');
   ASSERT_EQ(mem.read_byte(0x7100), 'I');
   ASSERT_EQ(out.str()[0], 'O');
   ASSERT_EQ(err.str()[0], 'E');
-  ASSERT_EQ(stopped, true);
+  ASSERT_EQ(mem.halted(), true);
 }
 
 TEST(InstructionTests, IType) {
@@ -98,6 +116,144 @@ TEST(InstructionTests, RType) {
   ASSERT_EQ(decoded.function, 16);
 }
 
+TEST(InstructionTests, Predecode) {
+  // same encodings as the IType and RType tests above
+  DecodedInstruction bne = Instruction{0x65E0FFFF}.predecode();
+  ASSERT_EQ(bne.operation, Operation::BNE);
+  ASSERT_EQ(bne.reg_a, 15);
+  ASSERT_EQ(bne.reg_b, 0);
+  ASSERT_EQ(bne.immediate, 65535);
+
+  DecodedInstruction sra = Instruction{0x73FF4B90}.predecode();
+  ASSERT_EQ(sra.operation, Operation::SRA);
+  ASSERT_EQ(sra.reg_a, 31);
+  ASSERT_EQ(sra.reg_b, 31);
+  ASSERT_EQ(sra.reg_c, 9);
+  ASSERT_EQ(sra.shift_value, 14);
+
+  // opcode 1 is unused, as is function code 1
+  ASSERT_EQ(Instruction{0x04000000}.predecode().operation, Operation::INVALID);
+  ASSERT_EQ(Instruction{0x70000001}.predecode().operation, Operation::INVALID);
+}
+
+class ScratchDevice : public MmioDevice {
+ public:
+  byte_t last_written = 0;
+
+  permission_t perms(address_t a) const override { return Read | Write; }
+  byte_t read_byte(address_t a) override { return a & 0xFF; }
+  void write_byte(address_t a, byte_t byte) override { last_written = byte; }
+};
+
+TEST(MemoryTests, PageTable) {
+  std::istringstream in;
+  std::ostringstream out, err;
+  ControllerState cont;
+  ScratchDevice device;
+
+  Memory<typeof(in), typeof(out), typeof(err)> mem(in, out, err, cont);
+  mem.map_device(0x7300, &device);
+
+  ASSERT_EQ(mem.read_byte(0x7342), 0x42);
+  mem.write_byte(0x7300, 7);
+  ASSERT_EQ(device.last_written, 7);
+  // devices only see byte accesses
+  ASSERT_EQ(mem.read_word(0x7342), 0);
+
+  // unmapped pages read as 0 and ignore writes
+  mem.write_byte(0x7400, 1);
+  ASSERT_EQ(mem.read_byte(0x7400), 0);
+
+  // the ROM isn't writable
+  mem.write_word(0x8000, 0x1234);
+  ASSERT_EQ(mem.read_word(0x8000), 0);
+
+  cont.push_button(A);
+  ASSERT_EQ(mem.read_byte(AddressSpace::ControllerIo), A);
+}
+
+TEST(MemoryTests, AddressClassAccessors) {
+  std::istringstream in("I");
+  std::ostringstream out, err;
+  ControllerState cont;
+
+  Memory<typeof(in), typeof(out), typeof(err)> mem(in, out, err, cont);
+
+  ASSERT_TRUE(is_ram_address(AddressSpace::VramStart));
+  ASSERT_FALSE(is_ram_address(AddressSpace::ControllerIo));
+
+  mem.write_word<AddressClass::Ram>(0x1401, 0xbeef);
+  ASSERT_EQ(mem.read_word(0x1400), 0xbeef);
+  ASSERT_EQ(mem.read_word<AddressClass::Ram>(0x1400), 0xbeef);
+  mem.write_byte<AddressClass::Ram>(0x1402, 0x42);
+  ASSERT_EQ(mem.read_byte<AddressClass::Ram>(0x1402), mem.read_byte(0x1402));
+
+  Rom rom = Rom::ReadRomFile("../rom-archive/hws/hello_world1.slug");
+  mem.mount_rom(rom);
+  ASSERT_EQ(mem.read_byte<AddressClass::Rom>(0x8000), 'S');
+  ASSERT_EQ(mem.read_word<AddressClass::Rom>(0x8002), mem.read_word(0x8002));
+
+  mem.write_byte<AddressClass::Mmio>(AddressSpace::Stdout, 'O');
+  ASSERT_EQ(out.str(), "O");
+  ASSERT_EQ(mem.read_byte<AddressClass::Mmio>(AddressSpace::Stdin), 'I');
+}
+
+TEST(MemoryTests, PredecodedRom) {
+  std::istringstream in;
+  std::ostringstream out, err;
+  ControllerState cont;
+
+  Memory<typeof(in), typeof(out), typeof(err)> mem(in, out, err, cont);
+
+  Rom rom = Rom::ReadRomFile("../rom-archive/hws/hello_world1.slug");
+  mem.mount_rom(rom);
+
+  for (uint32_t a = AddressSpace::RomStart; a < MEMORY_SIZE; a += 4) {
+    DecodedInstruction expected =
+        Instruction{mem.read_instruction(a)}.predecode();
+    DecodedInstruction cached = mem.read_decoded_instruction(a);
+    ASSERT_EQ(cached.operation, expected.operation) << std::hex << a;
+    ASSERT_EQ(cached.reg_a, expected.reg_a) << std::hex << a;
+    ASSERT_EQ(cached.reg_b, expected.reg_b) << std::hex << a;
+    ASSERT_EQ(cached.reg_c, expected.reg_c) << std::hex << a;
+    ASSERT_EQ(cached.shift_value, expected.shift_value) << std::hex << a;
+    ASSERT_EQ(cached.immediate, expected.immediate) << std::hex << a;
+  }
+}
+
+TEST(BlitTests, GrayscaleBlitter) {
+  std::vector<byte_t> frame(WindowArea);
+  for (size_t i = 0; i < WindowArea; i++) frame[i] = i * 13 + i / 7;
+
+  std::uint32_t argb8888[256], rgb565[256];
+  for (std::uint32_t gray = 0; gray < 256; gray++) {
+    argb8888[gray] = 0xff000000 | gray * 0x010101;
+    rgb565[gray] = (gray >> 3 << 11) | (gray >> 2 << 5) | (gray >> 3);
+  }
+  ASSERT_FALSE(GrayscaleBlitter(rgb565).vectorized());
+
+  // every scale, SIMD or not, into rows padded past the scaled frame's
+  // width, which must be left alone
+  for (int scale = 1; scale <= MAX_BLIT_SCALE; scale++) {
+    const size_t width = WindowWidth * scale, stride = width + 8;
+    for (const std::uint32_t *table : {argb8888, rgb565}) {
+      std::vector<std::uint32_t> pixels(stride * WindowHeight * scale,
+                                        0x12345678);
+      GrayscaleBlitter(table, scale)
+          .blit(frame.data(), pixels.data(), stride * 4);
+      for (size_t y = 0; y < WindowHeight * scale; y++) {
+        for (size_t x = 0; x < stride; x++) {
+          std::uint32_t expected =
+              x < width ? table[frame[y / scale * WindowWidth + x / scale]]
+                        : 0x12345678;
+          ASSERT_EQ(pixels[y * stride + x], expected)
+              << x << ", " << y << " at scale " << scale;
+        }
+      }
+    }
+  }
+}
+
 TEST(RomTest, testRom) {
   Rom testrom = Rom::ReadRomFile("../rom-archive/hws/hello_world1.slug");
   // for (int i = 0; i < 4; i++) {
@@ -266,6 +422,774 @@ TEST(InstructionTests_I, IType) {
   }
 }
 
+const char *const ARCHIVE_ROMS[] = {
+    "../rom-archive/hws/hello_world1.slug",
+    "../rom-archive/hws/hello_world2.slug",
+    "../rom-archive/hws/hello_world3.slug",
+    "../rom-archive/gpu/box.slug",
+    "../rom-archive/gpu/image.slug",
+    "../rom-archive/gpu/input.slug",
+    "../rom-archive/games/flappy_bird.slug",
+    "../rom-archive/games/snake.slug",
+};
+
+// everything a run of a ROM leaves behind
+struct CoreRun {
+  std::vector<byte_t> ram;
+  std::vector<register_value_t> registers;
+  register_value_t program_counter;
+  std::uint64_t instruction_count;
+  std::uint64_t frame_count;
+  std::string out, err;
+};
+
+// runs up to `frames` frames of rom on core, with a controller script that
+// moves to another button every few frames. the Aot core runs `recompiled`
+static CoreRun run_core(const Rom &rom, InterpreterCore core, int frames,
+                        const std::string &recompiled = "") {
+  std::istringstream in("some input\nfor the ROMs that read it\n");
+  std::ostringstream out, err;
+  Emulator emu(in, out, err);
+  if (core == InterpreterCore::Aot) {
+    EXPECT_TRUE(emu.load_recompiled_rom(recompiled, rom)) << recompiled;
+  }
+  emu.set_interpreter_core(core);
+  emu.reset(rom);
+  for (int f = 0; f < frames && !emu.is_halted(); f++) {
+    ControllerState cont;
+    cont.push_button(static_cast<ControllerButton>(1 << (f / 6 % 8)));
+    if (f % 5 == 0) cont.push_button(START);
+    emu.step_frames(1, cont);
+  }
+
+  CoreRun run;
+  run.ram.assign(emu.get_ram(), emu.get_ram() + AddressSpace::RamSize);
+  for (std::uint8_t r = 0; r < 32; r++) {
+    run.registers.push_back(emu.get_register_value(r));
+  }
+  run.program_counter = emu.get_program_counter();
+  run.instruction_count = emu.get_instruction_count();
+  run.frame_count = emu.get_frame_count();
+  run.out = out.str();
+  run.err = err.str();
+  return run;
+}
+
+static void expect_same_run(const CoreRun &a, const CoreRun &b,
+                            const std::string &what) {
+  EXPECT_EQ(a.instruction_count, b.instruction_count) << what;
+  EXPECT_EQ(a.frame_count, b.frame_count) << what;
+  EXPECT_EQ(a.program_counter, b.program_counter) << what;
+  EXPECT_EQ(a.registers, b.registers) << what;
+  EXPECT_TRUE(a.ram == b.ram) << what;
+  EXPECT_EQ(a.out, b.out) << what;
+  EXPECT_EQ(a.err, b.err) << what;
+}
+
+TEST(EmulatorTests, InterpreterCoresAgree) {
+  for (const char *path : ARCHIVE_ROMS) {
+    Rom rom = Rom::ReadRomFile(path);
+    CoreRun reference = run_core(rom, InterpreterCore::Switch, 90);
+    ASSERT_GT(reference.instruction_count, 0u) << path;
+    for (InterpreterCore core :
+         {InterpreterCore::Threaded, InterpreterCore::Jit}) {
+      expect_same_run(reference, run_core(rom, core, 90),
+                      std::string(path) + " on core " +
+                          std::to_string(static_cast<int>(core)));
+    }
+  }
+}
+
+TEST(EmulatorTests, RecompiledRom) {
+  const char *names[] = {"box", "hello_world3"};
+  const char *paths[] = {"../rom-archive/gpu/box.slug",
+                         "../rom-archive/hws/hello_world3.slug"};
+
+  for (int i = 0; i < 2; i++) {
+    std::string source = std::string("test_aot_") + names[i] + ".cpp";
+    std::string library = std::string("./test_aot_") + names[i] + ".so";
+    std::string recompile =
+        std::string(RECOMPILE_PATH) + " " + paths[i] + " " + source;
+    std::string build = std::string(CXX_PATH) +
+                        " -O0 -shared -fPIC -std=c++17 -I " SOURCE_DIR " " +
+                        source + " -o " + library;
+    ASSERT_EQ(std::system(recompile.c_str()), 0) << recompile;
+    ASSERT_EQ(std::system(build.c_str()), 0) << build;
+
+    Rom rom = Rom::ReadRomFile(paths[i]);
+    expect_same_run(run_core(rom, InterpreterCore::Switch, 90),
+                    run_core(rom, InterpreterCore::Aot, 90, library),
+                    paths[i]);
+
+    // built for the other ROM, so it must be turned down
+    Rom other = Rom::ReadRomFile(paths[1 - i]);
+    Emulator emu;
+    ASSERT_FALSE(emu.load_recompiled_rom(library, other)) << library;
+
+    std::remove(source.c_str());
+    std::remove(library.c_str());
+  }
+}
+
+TEST(BatchTests, EmptyStdin) {
+  // every session reads its name from an empty stdin, so gets none
+  const int sessions = 16;
+  std::ofstream manifest("test_batch.txt");
+  for (int i = 0; i < sessions; i++) {
+    manifest << "../rom-archive/hws/hello_world3.slug 10\n";
+  }
+  manifest.close();
+  std::string batch = std::string(BATCH_PATH) +
+                      " --jobs=4 --output-dir=test_batch test_batch.txt"
+                      " > test_batch.log";
+  ASSERT_EQ(std::system("mkdir -p test_batch"), 0);
+  ASSERT_EQ(std::system(batch.c_str()), 0) << batch;
+
+  for (int i = 0; i < sessions; i++) {
+    std::ifstream out("test_batch/" + std::to_string(i) + ".out");
+    std::string text((std::istreambuf_iterator<char>(out)),
+                     std::istreambuf_iterator<char>());
+    ASSERT_EQ(text, "Hello, stdout!\nEnter name: \nHi, !\n") << i;
+  }
+  std::system("rm -r test_batch test_batch.txt test_batch.log");
+}
+
+TEST(EmulatorTests, Headless) {
+  Rom rom = Rom::ReadRomFile("../rom-archive/gpu/box.slug");
+  Emulator emu;
+
+  emu.execute_rom(rom, 30);
+
+  ASSERT_EQ(emu.get_frame_count(), 30);
+  const byte_t *vram = emu.get_vram();
+  ASSERT_TRUE(std::any_of(vram, vram + WindowArea,
+                          [](byte_t pixel) { return pixel != 0; }))
+      << "box.slug should have drawn something.";
+}
+
+TEST(EmulatorTests, StepFrames) {
+  Rom snake = Rom::ReadRomFile("../rom-archive/games/snake.slug");
+  Emulator emu;
+  ControllerState up;
+  up.push_button(UP);
+
+  // views point straight into memory
+  ASSERT_EQ(emu.get_ram(), emu.get_memory().get_memory_buffer());
+  ASSERT_EQ(emu.get_vram(), emu.get_ram() + AddressSpace::VramStart);
+
+  emu.reset(snake);
+  ASSERT_EQ(emu.step_frames(10, ControllerState()), 10);
+  ASSERT_EQ(emu.step_frames(5, up), 5);
+  std::vector<byte_t> ram(emu.get_ram(), emu.get_ram() + AddressSpace::RamSize);
+  std::uint64_t instructions = emu.get_instruction_count();
+
+  // a reset starts over from the same state
+  emu.reset(snake);
+  ASSERT_EQ(emu.get_frame_count(), 0);
+  emu.step_frames(10, ControllerState());
+  emu.step_frames(5, up);
+  ASSERT_EQ(emu.get_instruction_count(), instructions);
+  ASSERT_TRUE(std::equal(ram.begin(), ram.end(), emu.get_ram()));
+
+  // hello_world1 stops itself during setup
+  Rom hello = Rom::ReadRomFile("../rom-archive/hws/hello_world1.slug");
+  testing::internal::CaptureStdout();
+  emu.reset(hello);
+  testing::internal::GetCapturedStdout();
+  ASSERT_TRUE(emu.is_halted());
+  ASSERT_EQ(emu.step_frames(10, ControllerState()), 0);
+}
+
+TEST(EmulatorTests, ManyInstances) {
+  Rom box = Rom::ReadRomFile("../rom-archive/gpu/box.slug");
+  Rom image = Rom::ReadRomFile("../rom-archive/gpu/image.slug");
+  std::vector<std::unique_ptr<Emulator>> emus;
+
+  for (int i = 0; i < 100; i++) {
+    emus.push_back(std::make_unique<Emulator>());
+    emus.back()->start_rom(i % 2 == 0 ? box : image);
+  }
+  // interleaved, so any state shared between instances would show
+  for (int frame = 0; frame < 5; frame++) {
+    for (auto &emu : emus) emu->execute_frame();
+  }
+
+  for (int i = 2; i < 100; i++) {
+    ASSERT_EQ(emus[i]->get_frame_count(), 5);
+    ASSERT_TRUE(std::equal(emus[i]->get_vram(),
+                           emus[i]->get_vram() + WindowArea,
+                           emus[i % 2]->get_vram()))
+        << "instance " << i;
+  }
+  ASSERT_FALSE(std::equal(emus[0]->get_vram(),
+                          emus[0]->get_vram() + WindowArea,
+                          emus[1]->get_vram()));
+}
+
+TEST(EmulatorTests, Fork) {
+  Rom snake = Rom::ReadRomFile("../rom-archive/games/snake.slug");
+  auto input = [](int i) {
+    ControllerState cont;
+    cont.push_button(static_cast<ControllerButton>(1 << i % 8));
+    return cont;
+  };
+  auto replay = [&](int i) {
+    auto emu = std::make_unique<Emulator>();
+    emu->set_interpreter_core(InterpreterCore::Threaded);
+    emu->reset(snake);
+    emu->step_frames(20, input(0));
+    emu->step_frames(30, input(i));
+    return emu;
+  };
+
+  Emulator parent;
+  parent.set_interpreter_core(InterpreterCore::Threaded);
+  parent.reset(snake);
+  parent.step_frames(20, input(0));
+  std::vector<byte_t> ram(parent.get_ram(),
+                          parent.get_ram() + AddressSpace::RamSize);
+
+  std::vector<std::unique_ptr<Emulator>> forks;
+  for (int i = 0; i < 8; i++) forks.push_back(parent.fork());
+  // the parent moving on doesn't show in the forks
+  parent.step_frames(20, input(1));
+  for (auto &fork : forks) {
+    ASSERT_EQ(fork->get_frame_count(), 20);
+    ASSERT_TRUE(std::equal(ram.begin(), ram.end(), fork->get_ram()));
+  }
+
+  // each on its own thread, with its own input
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([&, i]() { forks[i]->step_frames(30, input(i)); });
+  }
+  for (std::thread &thread : threads) thread.join();
+  for (int i = 0; i < 8; i++) {
+    std::unique_ptr<Emulator> emu = replay(i);
+    ASSERT_EQ(forks[i]->get_instruction_count(), emu->get_instruction_count());
+    ASSERT_TRUE(std::equal(emu->get_ram(),
+                           emu->get_ram() + AddressSpace::RamSize,
+                           forks[i]->get_ram()))
+        << "fork " << i;
+  }
+
+  // forks of forks, and of an emulator that wasn't written in between
+  std::unique_ptr<Emulator> child = forks[3]->fork();
+  std::unique_ptr<Emulator> sibling = forks[3]->fork();
+  forks[3]->step_frames(5, input(0));
+  ram.assign(child->get_ram(), child->get_ram() + AddressSpace::RamSize);
+  ASSERT_TRUE(std::equal(ram.begin(), ram.end(), sibling->get_ram()));
+  ASSERT_FALSE(std::equal(ram.begin(), ram.end(), forks[3]->get_ram()));
+  ASSERT_TRUE(std::equal(ram.begin(), ram.end(), replay(3)->get_ram()));
+}
+
+TEST(EmulatorTests, ForkPastFileLimit) {
+  rlimit limit;
+  ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &limit), 0);
+  if (limit.rlim_max <= 1200) GTEST_SKIP() << "hard file limit too low";
+  rlimit lowered = limit;
+  lowered.rlim_cur = 1024;
+  ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &lowered), 0);
+
+  // each fork is written before it is forked, so each takes a snapshot of
+  // its own, and all of them stay alive
+  Rom snake = Rom::ReadRomFile("../rom-archive/games/snake.slug");
+  Emulator reference;
+  reference.set_interpreter_core(InterpreterCore::Threaded);
+  reference.reset(snake);
+  std::vector<std::unique_ptr<Emulator>> forks;
+  forks.push_back(std::make_unique<Emulator>());
+  forks.back()->set_interpreter_core(InterpreterCore::Threaded);
+  forks.back()->reset(snake);
+  testing::internal::CaptureStderr();
+  for (int i = 0; i < 1100; i++) {
+    forks.back()->step_frames(1, ControllerState());
+    forks.push_back(forks.back()->fork());
+  }
+  std::string warnings = testing::internal::GetCapturedStderr();
+
+  rlimit raised;
+  ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &raised), 0);
+  ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &limit), 0);
+  // the limit went up rather than the forks falling back to copies
+  ASSERT_EQ(raised.rlim_cur, limit.rlim_max);
+  ASSERT_EQ(warnings.find("copying"), std::string::npos) << warnings;
+  // the newest fork hasn't stepped past its parent
+  for (size_t i = 0; i < forks.size(); i++) {
+    if (i + 1 < forks.size()) reference.step_frames(1, ControllerState());
+    ASSERT_EQ(forks[i]->get_frame_count(), reference.get_frame_count());
+    ASSERT_TRUE(std::equal(reference.get_ram(),
+                           reference.get_ram() + AddressSpace::RamSize,
+                           forks[i]->get_ram()))
+        << "fork " << i;
+  }
+}
+
+// encodes instructions for the small ROMs below
+static std::uint32_t i_type(Opcode op, int a, int b, std::uint16_t immediate) {
+  return static_cast<std::uint32_t>(op) << 26 | a << 21 | b << 16 | immediate;
+}
+
+static std::uint32_t r_type(FunctionCode function, int a, int b, int c) {
+  return static_cast<std::uint32_t>(Opcode::RTYPE) << 26 | a << 21 | b << 16 |
+         c << 11 | static_cast<std::uint32_t>(function);
+}
+
+// a ROM whose code starts at 0x8200, with setup and loop where given
+static Rom make_rom(const std::vector<std::uint32_t> &code,
+                    std::uint32_t setup, std::uint32_t loop) {
+  std::string contents(SLUGValues::FILE_SIZE, '\0');
+  auto put = [&](size_t offset, std::uint32_t word) {
+    for (int i = 0; i < 4; i++) contents[offset + i] = word >> (24 - 8 * i);
+  };
+  put(SLUGAddressSpecifier::SETUP, setup);
+  put(SLUGAddressSpecifier::LOOP, loop);
+  put(SLUGAddressSpecifier::LDA_ROM, 0x8000);
+  for (size_t i = 0; i < code.size(); i++) put(0x200 + 4 * i, code[i]);
+  std::string filename = "test_rom.slug";
+  std::ofstream(filename, std::ios::binary) << contents;
+  Rom rom = Rom::ReadRomFile(filename);
+  std::remove(filename.c_str());
+  return rom;
+}
+
+TEST(EmulatorTests, IdleLoop) {
+  // setup returns; loop waits for START, then draws a pixel
+  const std::uint32_t loop = 0x8204;
+  Rom rom = make_rom(
+      {
+          r_type(FunctionCode::JR, 31, 0, 0),
+          i_type(Opcode::LBU, 0, 2, AddressSpace::ControllerIo),
+          i_type(Opcode::ORI, 0, 1, START),
+          r_type(FunctionCode::AND, 2, 1, 2),
+          i_type(Opcode::BEQ, 2, 0, static_cast<std::uint16_t>(-4)),
+          i_type(Opcode::ORI, 0, 3, 0x55),
+          i_type(Opcode::SB, 0, 3, AddressSpace::VramStart),
+          r_type(FunctionCode::JR, 31, 0, 0),
+      },
+      0x8200, loop);
+
+  ControllerState start;
+  start.push_button(START);
+  for (InterpreterCore core :
+       {InterpreterCore::Switch, InterpreterCore::Threaded,
+        InterpreterCore::Jit}) {
+    Emulator emu;
+    emu.set_interpreter_core(core);
+    emu.reset(rom);
+
+    // without START the loop would spin forever. each frame goes round until
+    // a trip changes nothing (twice in the first, once after), and the next
+    // carries on from the poll
+    ASSERT_EQ(emu.step_frames(10, ControllerState()), 10);
+    ASSERT_EQ(emu.get_idle_frame_count(), 10);
+    ASSERT_EQ(emu.get_instruction_count(), 1 + 2 * 4 + 9 * 4);
+    ASSERT_EQ(emu.get_program_counter(), loop);
+    ASSERT_EQ(emu.get_vram()[0], 0);
+
+    ASSERT_EQ(emu.step_frames(1, start), 1);
+    ASSERT_EQ(emu.get_idle_frame_count(), 10);
+    ASSERT_EQ(emu.get_program_counter(), 0);
+    ASSERT_EQ(emu.get_vram()[0], 0x55);
+  }
+}
+
+TEST(EmulatorTests, InstructionBudget) {
+  // loop counts in r2 and stores it, forever
+  Rom forever = make_rom(
+      {
+          r_type(FunctionCode::JR, 31, 0, 0),
+          i_type(Opcode::ADDI, 2, 2, 1),
+          i_type(Opcode::SB, 0, 2, 0x100),
+          i_type(Opcode::BEQ, 0, 0, static_cast<std::uint16_t>(-3)),
+      },
+      0x8200, 0x8204);
+  InstructionBudget budget;
+  budget.frame = 1000;
+
+  for (InterpreterCore core :
+       {InterpreterCore::Switch, InterpreterCore::Threaded,
+        InterpreterCore::Jit}) {
+    Emulator emu;
+    emu.set_interpreter_core(core);
+
+    // stopped at the first frame, with the reason on stderr
+    budget.policy = OverrunPolicy::Abort;
+    emu.set_instruction_budget(budget);
+    emu.reset(forever);
+    testing::internal::CaptureStderr();
+    ASSERT_EQ(emu.step_frames(5, ControllerState()), 0);
+    std::string dump = testing::internal::GetCapturedStderr();
+    ASSERT_NE(dump.find("frame 0 ran past its budget of 1000"),
+              std::string::npos)
+        << dump;
+    ASSERT_TRUE(emu.is_halted());
+    BudgetStats stats = emu.get_budget_stats();
+    ASSERT_EQ(stats.setup_instructions, 1);
+    ASSERT_EQ(stats.overruns, 1);
+    ASSERT_GE(stats.last_overrun_pc, 0x8204);
+    ASSERT_LE(stats.last_overrun_pc, 0x820c);
+
+    // each frame picks up the count where the last one left it
+    budget.policy = OverrunPolicy::Carry;
+    emu.set_instruction_budget(budget);
+    emu.reset(forever);
+    ASSERT_EQ(emu.step_frames(5, ControllerState()), 5);
+    stats = emu.get_budget_stats();
+    ASSERT_EQ(stats.overruns, 5);
+    ASSERT_GE(stats.max_frame_instructions, 1000);
+    ASSERT_LT(stats.max_frame_instructions, 1000 + 3);
+    ASSERT_EQ(emu.get_ram()[0x100],
+              static_cast<byte_t>(emu.get_register_value(2)));
+    ASSERT_GE(emu.get_register_value(2), 5 * 1000 / 3);
+
+    // each frame is undone, so it never gets anywhere
+    budget.policy = OverrunPolicy::Drop;
+    emu.set_instruction_budget(budget);
+    emu.reset(forever);
+    ASSERT_EQ(emu.step_frames(5, ControllerState()), 5);
+    ASSERT_EQ(emu.get_budget_stats().overruns, 5);
+    ASSERT_EQ(emu.get_register_value(2), 0);
+    ASSERT_EQ(emu.get_program_counter(), 0);
+    ASSERT_EQ(emu.get_ram()[0x100], 0);
+  }
+
+  // a budget that is never reached changes nothing
+  Rom snake = Rom::ReadRomFile("../rom-archive/games/snake.slug");
+  Emulator limited, unlimited;
+  budget.frame = 1000000;
+  budget.policy = OverrunPolicy::Abort;
+  limited.set_instruction_budget(budget);
+  for (Emulator *emu : {&limited, &unlimited}) {
+    emu->set_interpreter_core(InterpreterCore::Threaded);
+    emu->reset(snake);
+    emu->step_frames(30, ControllerState());
+  }
+  ASSERT_EQ(limited.get_budget_stats().overruns, 0);
+  ASSERT_GT(limited.get_budget_stats().max_frame_instructions, 0);
+  ASSERT_EQ(limited.get_instruction_count(), unlimited.get_instruction_count());
+  ASSERT_TRUE(std::equal(limited.get_ram(),
+                         limited.get_ram() + AddressSpace::RamSize,
+                         unlimited.get_ram()));
+}
+
+TEST(EmulatorTests, InstructionBudgetRunAhead) {
+  // each frame counts at 0x100 and writes 0xaa to 0x200 on the first; with
+  // START it writes 0x55 there and spins
+  Rom rom = make_rom(
+      {
+          r_type(FunctionCode::JR, 31, 0, 0),
+          i_type(Opcode::LBU, 0, 2, 0x100),
+          i_type(Opcode::ADDI, 2, 2, 1),
+          i_type(Opcode::SB, 0, 2, 0x100),
+          i_type(Opcode::ORI, 0, 3, 1),
+          i_type(Opcode::BNE, 2, 3, 2),
+          i_type(Opcode::ORI, 0, 4, 0xaa),
+          i_type(Opcode::SB, 0, 4, 0x200),
+          i_type(Opcode::LBU, 0, 5, AddressSpace::ControllerIo),
+          i_type(Opcode::ORI, 0, 6, START),
+          r_type(FunctionCode::AND, 5, 6, 5),
+          i_type(Opcode::BEQ, 5, 0, 3),
+          i_type(Opcode::ORI, 0, 7, 0x55),
+          i_type(Opcode::SB, 0, 7, 0x200),
+          i_type(Opcode::BEQ, 0, 0, static_cast<std::uint16_t>(-1)),
+          r_type(FunctionCode::JR, 31, 0, 0),
+      },
+      0x8200, 0x8204);
+  InstructionBudget budget;
+  budget.frame = 1000;
+  ControllerState start;
+  start.push_button(START);
+
+  for (InterpreterCore core :
+       {InterpreterCore::Switch, InterpreterCore::Threaded,
+        InterpreterCore::Jit}) {
+    Emulator emu;
+    emu.set_interpreter_core(core);
+
+    // the frames run ahead write pages the checkpoint for dropping saved
+    // partway through; rolling them back must leave the next save copying
+    // them again
+    budget.policy = OverrunPolicy::Drop;
+    emu.set_instruction_budget(budget);
+    emu.reset(rom);
+    emu.run_ahead(2);
+    ASSERT_EQ(emu.step_frames(1, start), 1);
+    ASSERT_EQ(emu.get_budget_stats().overruns, 1);
+    ASSERT_EQ(emu.get_ram()[0x100], 0);
+    ASSERT_EQ(emu.get_ram()[0x200], 0);
+
+    // an overrun ahead of time neither reports nor halts anything...
+    budget.policy = OverrunPolicy::Abort;
+    emu.set_instruction_budget(budget);
+    emu.reset(rom);
+    emu.get_controller().push_button(START);
+    testing::internal::CaptureStderr();
+    emu.run_ahead(2);
+    ASSERT_EQ(testing::internal::GetCapturedStderr(), "");
+    ASSERT_FALSE(emu.is_halted());
+    ASSERT_EQ(emu.get_budget_stats().overruns, 0);
+
+    // ...until the frame really runs
+    testing::internal::CaptureStderr();
+    ASSERT_EQ(emu.step_frames(1, start), 0);
+    std::string dump = testing::internal::GetCapturedStderr();
+    ASSERT_NE(dump.find("frame 0 ran past its budget"), std::string::npos)
+        << dump;
+    ASSERT_EQ(dump.find("budget", dump.find("budget") + 1), std::string::npos)
+        << dump;
+    ASSERT_TRUE(emu.is_halted());
+  }
+}
+
+TEST(EmulatorTests, RunAhead) {
+  Rom snake = Rom::ReadRomFile("../rom-archive/games/snake.slug");
+  Emulator emu, twin;
+  for (Emulator *e : {&emu, &twin}) {
+    e->set_interpreter_core(InterpreterCore::Threaded);
+    e->reset(snake);
+  }
+
+  for (int i = 0; i < 40; i++) {
+    ControllerState cont;
+    cont.push_button(i < 20 ? UP : LEFT);
+    emu.step_frames(1, cont);
+    twin.step_frames(1, cont);
+
+    // shows the frame the emulator gets to 3 frames on...
+    std::unique_ptr<Emulator> ahead = twin.fork();
+    ahead->step_frames(3, cont);
+    const byte_t *vram = emu.run_ahead(3);
+    ASSERT_TRUE(std::equal(vram, vram + WindowArea, ahead->get_vram()))
+        << "frame " << i;
+
+    // ...and leaves it as if it never went there
+    ASSERT_EQ(emu.get_frame_count(), twin.get_frame_count());
+    ASSERT_EQ(emu.get_instruction_count(), twin.get_instruction_count());
+    ASSERT_EQ(emu.get_program_counter(), twin.get_program_counter());
+    ASSERT_TRUE(std::equal(emu.get_ram(), emu.get_ram() + AddressSpace::RamSize,
+                           twin.get_ram()))
+        << "frame " << i;
+  }
+  ASSERT_EQ(emu.run_ahead(0), emu.get_vram());
+}
+
+TEST(EmulatorTests, ChangedRows) {
+  Rom snake = Rom::ReadRomFile("../rom-archive/games/snake.slug");
+  Emulator emu;
+  emu.set_interpreter_core(InterpreterCore::Threaded);
+  emu.reset(snake);
+
+  // what a window redrawing only the changed rows would show
+  std::vector<byte_t> shown(WindowArea);
+  size_t drawn = 0;
+  for (int i = 0; i < 120; i++) {
+    ControllerState cont;
+    cont.push_button(i % 40 < 20 ? UP : LEFT);
+    emu.step_frames(1, cont);
+    // runs ahead some frames and not others, ending on one that doesn't
+    const byte_t *frame = emu.run_ahead((i + 1) % 3);
+    std::bitset<WindowHeight> rows = emu.take_changed_rows();
+    for (size_t y = 0; y < WindowHeight; y++) {
+      if (!rows[y]) continue;
+      std::copy_n(frame + y * WindowWidth, WindowWidth,
+                  shown.begin() + y * WindowWidth);
+      drawn++;
+    }
+    ASSERT_TRUE(std::equal(shown.begin(), shown.end(), frame))
+        << "frame " << i;
+  }
+  ASSERT_GT(drawn, 0u);
+  ASSERT_TRUE(emu.take_changed_rows().none());
+
+  // of the rows snake writes, only those that moved are kept
+  std::vector<byte_t> before(shown);
+  ControllerState cont;
+  emu.step_frames(1, cont);
+  std::bitset<WindowHeight> rows = emu.take_changed_rows();
+  ASSERT_GT(rows.count(), 0u);
+  keep_changed_rows(emu.get_vram(), before.data(), rows);
+  ASSERT_TRUE(std::equal(before.begin(), before.end(), emu.get_vram()));
+  for (size_t y = 0; y < WindowHeight; y++) {
+    ASSERT_EQ(rows[y], !std::equal(shown.begin() + y * WindowWidth,
+                                   shown.begin() + (y + 1) * WindowWidth,
+                                   emu.get_vram() + y * WindowWidth))
+        << y;
+  }
+}
+
+TEST(HandoffTests, FrameMailbox) {
+  auto frames = std::make_unique<FrameMailbox>();
+  ASSERT_EQ(frames->take(), nullptr);
+
+  std::bitset<WindowHeight> rows;
+  frames->back().vram[0] = 1;
+  frames->publish(rows.set(1));
+  const FrameMailbox::Frame *frame = frames->take();
+  ASSERT_NE(frame, nullptr);
+  ASSERT_EQ(frame->vram[0], 1);
+  ASSERT_EQ(frame->changed_rows, rows);
+  ASSERT_EQ(frames->take(), nullptr);
+
+  // frames not taken in time are skipped, but not the rows they changed
+  for (byte_t i = 2; i < 6; i++) {
+    frames->back().vram[0] = i;
+    frames->publish(std::bitset<WindowHeight>().set(i));
+  }
+  frame = frames->take();
+  ASSERT_EQ(frame->vram[0], 5);
+  ASSERT_EQ(frame->changed_rows, std::bitset<WindowHeight>(0b111100));
+  ASSERT_EQ(frames->take(), nullptr);
+
+  // the publisher can't tell whether the last frame will be taken, so each
+  // frame reports the rows of the one before it too
+  frames->publish(std::bitset<WindowHeight>().set(6));
+  ASSERT_EQ(frames->take()->changed_rows, std::bitset<WindowHeight>(0b1111100));
+  frames->publish(std::bitset<WindowHeight>().set(7));
+  ASSERT_EQ(frames->take()->changed_rows, std::bitset<WindowHeight>(0xc0));
+}
+
+TEST(HandoffTests, InputQueue) {
+  InputQueue input;
+  InputEvent event;
+  ASSERT_FALSE(input.pop(event));
+
+  // a full queue drops what is pushed
+  size_t pushed = 0;
+  while (input.push({InputEvent::Press, UP})) pushed++;
+  ASSERT_GT(pushed, 0u);
+  for (size_t i = 0; i < pushed; i++) ASSERT_TRUE(input.pop(event));
+  ASSERT_FALSE(input.pop(event));
+
+  // events arrive in order from another thread
+  constexpr int EVENTS = 100'000;
+  std::thread producer([&input]() {
+    for (int i = 0; i < EVENTS; i++) {
+      InputEvent sent{i % 2 ? InputEvent::Release : InputEvent::Press,
+                      static_cast<ControllerButton>(1 << (i / 2 % 8))};
+      while (!input.push(sent)) std::this_thread::yield();
+    }
+  });
+  for (int i = 0; i < EVENTS; i++) {
+    while (!input.pop(event)) std::this_thread::yield();
+    ASSERT_EQ(event.kind, i % 2 ? InputEvent::Release : InputEvent::Press);
+    ASSERT_EQ(event.button, 1 << (i / 2 % 8));
+  }
+  producer.join();
+}
+
+TEST(SchedulerTests, FrameScheduler) {
+  using namespace std::chrono;
+  auto elapsed_ms = [](steady_clock::time_point start) {
+    return duration_cast<milliseconds>(steady_clock::now() - start).count();
+  };
+
+  // 4 ms frames at 2x, then at 0.5x; only lower bounds, as a busy machine
+  // can always make waits longer
+  FrameScheduler scheduler(milliseconds(4), 2);
+  auto start = steady_clock::now();
+  for (int i = 0; i < 20; i++) scheduler.wait();
+  ASSERT_GE(elapsed_ms(start), 40);
+  scheduler.set_speed(0.5);
+  start = steady_clock::now();
+  for (int i = 0; i < 5; i++) scheduler.wait();
+  ASSERT_GE(elapsed_ms(start), 40);
+
+  // a frame started well after its deadline is late, and the next one is
+  // due a period after it rather than at once
+  std::this_thread::sleep_for(milliseconds(20));
+  scheduler.wait();
+  start = steady_clock::now();
+  scheduler.wait();
+  ASSERT_GE(elapsed_ms(start), 7);
+
+  // uncapped doesn't wait or count towards the timing
+  scheduler.set_speed(0);
+  for (int i = 0; i < 1000; i++) scheduler.wait();
+  FrameScheduler::Stats stats = scheduler.get_stats();
+  ASSERT_EQ(stats.frames, 1027u);
+  ASSERT_EQ(stats.paced_frames, 27u);
+  ASSERT_GE(stats.late_frames, 1u);
+  ASSERT_GE(stats.max_jitter_us, 8000);
+  ASSERT_LE(stats.mean_jitter_us, stats.max_jitter_us);
+
+  // stopping cuts a long wait short, and the waits after it
+  FrameScheduler slow(milliseconds(4), 0.001);
+  std::thread stopper([&]() {
+    std::this_thread::sleep_for(milliseconds(20));
+    slow.stop();
+  });
+  start = steady_clock::now();
+  slow.wait();
+  slow.wait();
+  stopper.join();
+  ASSERT_LT(elapsed_ms(start), 2000);
+  ASSERT_EQ(slow.get_stats().paced_frames, 0u);
+}
+
+TEST(LockstepTests, MatchesEmulator) {
+  const char *roms[] = {"../rom-archive/gpu/input.slug",
+                        "../rom-archive/games/snake.slug"};
+
+  for (const char *path : roms) {
+    Rom rom = Rom::ReadRomFile(path);
+    // 20 lanes, so both the vector and the scalar ALU paths run
+    LockstepEmulator lanes(20);
+    std::vector<std::unique_ptr<Emulator>> emus;
+
+    lanes.start_rom(rom);
+    for (size_t i = 0; i < lanes.get_lane_count(); i++) {
+      emus.push_back(std::make_unique<Emulator>());
+      emus[i]->start_rom(rom);
+    }
+
+    // a different button sequence in every lane makes them diverge
+    for (int frame = 0; frame < 12; frame++) {
+      for (size_t i = 0; i < lanes.get_lane_count(); i++) {
+        auto button = static_cast<ControllerButton>(1 << ((i + frame / 3) % 8));
+        lanes.get_controller(i) = ControllerState();
+        lanes.get_controller(i).push_button(button);
+        emus[i]->get_controller() = ControllerState();
+        emus[i]->get_controller().push_button(button);
+        emus[i]->execute_frame();
+      }
+      lanes.execute_frame();
+    }
+
+    std::uint64_t instructions = 0;
+    for (size_t i = 0; i < lanes.get_lane_count(); i++) {
+      const byte_t *memory = lanes.get_memory(i).get_memory_buffer();
+      const byte_t *expected = emus[i]->get_memory().get_memory_buffer();
+      ASSERT_TRUE(std::equal(memory, memory + AddressSpace::RamSize, expected))
+          << path << " lane " << i;
+      for (int r = 0; r < NUM_REGISTERS; r++) {
+        ASSERT_EQ(lanes.get_register_value(i, r),
+                  emus[i]->get_register_value(r))
+            << path << " lane " << i << " r" << r;
+      }
+      instructions += emus[i]->get_instruction_count();
+    }
+    ASSERT_EQ(lanes.get_instruction_count(), instructions) << path;
+  }
+}
+
+TEST(LockstepTests, Halt) {
+  Rom rom = Rom::ReadRomFile("../rom-archive/hws/hello_world1.slug");
+  LockstepEmulator lanes(3);
+
+  testing::internal::CaptureStdout();
+  Emulator emu;
+  emu.execute_rom(rom);
+  std::string expected = testing::internal::GetCapturedStdout();
+
+  lanes.start_rom(rom);
+  lanes.execute_frame();
+  for (size_t i = 0; i < lanes.get_lane_count(); i++) {
+    ASSERT_TRUE(lanes.is_halted(i));
+    ASSERT_EQ(lanes.get_output(i), expected);
+  }
+}
+
 TEST(EmulatorStateTest, SaveLoadState) {
   Emulator emu1;
   emu1.set_register_value(1, 1234);
@@ -302,6 +1226,161 @@ TEST(EmulatorStateTest, SaveLoadState) {
   std::remove(filename.c_str());
 }
 
+TEST(EmulatorStateTest, SaveStateFile) {
+  Rom snake = Rom::ReadRomFile("../rom-archive/games/snake.slug");
+  std::string filename = "emu_state_file_test.bin";
+  ControllerState up;
+  up.push_button(UP);
+
+  Emulator emu1;
+  emu1.reset(snake);
+  emu1.step_frames(20, up);
+  emu1.save_state(filename);
+  // the state was copied when saving, whatever happens next
+  std::vector<byte_t> ram(emu1.get_ram(),
+                          emu1.get_ram() + AddressSpace::RamSize);
+  emu1.step_frames(10, up);
+  ASSERT_TRUE(Emulator::finish_saving());
+
+  // frame count and loop address come along, so frames run straight away
+  Emulator emu2;
+  ASSERT_TRUE(emu2.load_state(filename));
+  ASSERT_EQ(emu2.get_frame_count(), 20);
+  ASSERT_TRUE(std::equal(ram.begin(), ram.end(), emu2.get_ram()));
+  emu2.step_frames(10, up);
+  ASSERT_TRUE(std::equal(emu1.get_ram(), emu1.get_ram() + AddressSpace::RamSize,
+                         emu2.get_ram()));
+
+  // a flipped bit or a short file is refused and changes nothing
+  std::string contents;
+  {
+    std::ifstream file(filename, std::ios::binary);
+    contents.assign(std::istreambuf_iterator<char>(file), {});
+  }
+  ASSERT_EQ(contents.size(), SAVE_STATE_SIZE);
+  contents[SAVE_STATE_MEMORY_OFFSET + 0x100] ^= 1;
+  std::ofstream(filename, std::ios::binary) << contents;
+  testing::internal::CaptureStderr();
+  ASSERT_FALSE(emu2.load_state(filename));
+  std::ofstream(filename, std::ios::binary) << contents.substr(0, 100);
+  ASSERT_FALSE(emu2.load_state(filename));
+  testing::internal::GetCapturedStderr();
+  ASSERT_EQ(emu2.get_frame_count(), 30);
+
+  std::remove(filename.c_str());
+}
+
+TEST(EmulatorStateTest, DeltaState) {
+  Rom snake = Rom::ReadRomFile("../rom-archive/games/snake.slug");
+  ControllerState up;
+  up.push_button(UP);
+
+  // the JIT core writes RAM from generated code, which has to mark pages too
+  Emulator emu1;
+  emu1.set_interpreter_core(InterpreterCore::Jit);
+  emu1.reset(snake);
+  emu1.step_frames(20, up);
+  std::stringstream delta;
+  emu1.save_delta_state(delta);
+  std::vector<byte_t> ram(emu1.get_ram(),
+                          emu1.get_ram() + AddressSpace::RamSize);
+  register_value_t pc = emu1.get_program_counter();
+  ASSERT_LT(delta.str().size(), AddressSpace::RamSize)
+      << "only the written pages should be saved.";
+
+  // loading rolls back what was written after saving
+  emu1.step_frames(20, ControllerState());
+  ASSERT_TRUE(emu1.load_delta_state(delta));
+  ASSERT_TRUE(std::equal(ram.begin(), ram.end(), emu1.get_ram()));
+  ASSERT_EQ(emu1.get_program_counter(), pc);
+
+  // another emulator that started the same ROM takes it too
+  Emulator emu2;
+  emu2.reset(snake);
+  delta.seekg(0);
+  ASSERT_TRUE(emu2.load_delta_state(delta));
+  ASSERT_TRUE(std::equal(ram.begin(), ram.end(), emu2.get_ram()));
+  for (int i = 0; i < NUM_REGISTERS; ++i) {
+    ASSERT_EQ(emu1.get_register_value(i), emu2.get_register_value(i));
+  }
+  emu1.step_frames(10, up);
+  emu2.step_frames(10, up);
+  ASSERT_TRUE(std::equal(emu1.get_ram(), emu1.get_ram() + AddressSpace::RamSize,
+                         emu2.get_ram()));
+
+  // nothing is written between setting the base and saving
+  std::stringstream empty1, empty2;
+  emu1.set_base_state();
+  emu1.save_delta_state(empty1);
+  emu1.step_frames(1, up);
+  emu1.save_delta_state(empty2);
+  ASSERT_LT(empty1.str().size(), empty2.str().size());
+  ASSERT_TRUE(emu1.load_delta_state(empty1));
+  ASSERT_TRUE(std::equal(emu2.get_ram(), emu2.get_ram() + AddressSpace::RamSize,
+                         emu1.get_ram()));
+
+  // a different ROM is refused and left alone
+  Rom box = Rom::ReadRomFile("../rom-archive/gpu/box.slug");
+  Emulator emu3;
+  emu3.reset(box);
+  std::vector<byte_t> box_ram(emu3.get_ram(),
+                              emu3.get_ram() + AddressSpace::RamSize);
+  delta.clear();
+  delta.seekg(0);
+  testing::internal::CaptureStderr();
+  ASSERT_FALSE(emu3.load_delta_state(delta));
+  testing::internal::GetCapturedStderr();
+  ASSERT_TRUE(std::equal(box_ram.begin(), box_ram.end(), emu3.get_ram()));
+}
+
+TEST(EmulatorStateTest, Rewind) {
+  Rom snake = Rom::ReadRomFile("../rom-archive/games/snake.slug");
+  Emulator emu;
+  emu.set_interpreter_core(InterpreterCore::Jit);
+  emu.enable_rewind(1 << 20);
+  emu.reset(snake);
+
+  // RAM after every frame, with the input changing now and then
+  auto input = [](std::uint64_t frame) {
+    ControllerState cont;
+    cont.push_button(frame % 20 < 10 ? UP : LEFT);
+    return cont;
+  };
+  std::vector<std::vector<byte_t>> rams;
+  for (std::uint64_t frame = 0; frame <= 60; frame++) {
+    rams.emplace_back(emu.get_ram(), emu.get_ram() + AddressSpace::RamSize);
+    emu.step_frames(1, input(frame));
+  }
+  std::uint64_t instructions = emu.get_instruction_count();
+
+  ASSERT_EQ(emu.rewind(10), 10);
+  ASSERT_EQ(emu.get_frame_count(), 51);
+  ASSERT_TRUE(std::equal(rams[51].begin(), rams[51].end(), emu.get_ram()));
+  ASSERT_EQ(emu.rewind(21), 21);
+  ASSERT_TRUE(std::equal(rams[30].begin(), rams[30].end(), emu.get_ram()));
+
+  // replaying the same input from there ends up in the same place
+  for (std::uint64_t frame = 30; frame <= 60; frame++) {
+    emu.step_frames(1, input(frame));
+  }
+  ASSERT_EQ(emu.get_frame_count(), 61);
+  ASSERT_GT(emu.get_instruction_count(), instructions);
+  emu.rewind(1);
+  ASSERT_TRUE(std::equal(rams[60].begin(), rams[60].end(), emu.get_ram()));
+
+  // a small arena keeps fewer frames, and every interval-th one
+  emu.enable_rewind(2 << 10, 4);
+  emu.reset(snake);
+  emu.step_frames(200, input(0));
+  RewindBuffer::Stats stats = emu.get_rewind_stats();
+  ASSERT_LE(stats.used_bytes, 2 << 10);
+  ASSERT_GT(stats.oldest_frame, 0);
+  ASSERT_EQ(stats.states, (200 - stats.oldest_frame) / 4 + 1);
+  ASSERT_EQ(emu.rewind(1), 4);
+  ASSERT_EQ(emu.rewind(1000), 196 - stats.oldest_frame);
+  ASSERT_EQ(emu.rewind(1), 0);
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
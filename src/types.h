@@ -3,7 +3,6 @@
 #include <arpa/inet.h>
 
 #include <cstdint>
-#include <functional>
 
 using instruction_t = std::uint32_t;
 using slug_space_t = std::uint32_t;
@@ -23,8 +22,6 @@ using byte_t = std::uint8_t;
 // a word is 16 bits
 using word_t = std::uint16_t;
 
-using stopper_fn_t = std::function<void(void)>;
-
 #ifdef RELEASE
 #define warn(msg)
 #else
@@ -1,29 +1,431 @@
 #include <SDL2/SDL.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
 
 #include "emulator.h"
 #include "gpu.h"
+#include "handoff.h"
 #include "rom.h"
+#include "scheduler.h"
 #include "types.h"
 
+using namespace std::chrono_literals;
+#define FRAME_PERIOD 16.67ms
+
+/*
+ * The SDL frontend: one window, keyboard input and frame pacing around a
+ * single Emulator. The emulator core itself doesn't depend on SDL.
+ *
+ * The emulator runs on a thread of its own and paces itself, so presenting
+ * frames can stall without slowing the game down. SDL wants its window and
+ * events looked after by the main thread, which does both.
+ */
+
+static void send(InputQueue &input, const InputEvent &event) {
+  if (!input.push(event)) warn("input queue full, dropping a key");
+}
+
+// passes keys on to the emulator thread, backspace for rewinding and tab for
+// turbo. returns false when the window was closed. the window is redrawn
+// whole once uncovered
+static bool handle_event(const SDL_Event &evt, InputQueue &input, Gpu &gpu) {
+  switch (evt.type) {
+    case SDL_WINDOWEVENT:
+      if (evt.window.event == SDL_WINDOWEVENT_CLOSE) {
+        warn("closing window due to quit");
+        return false;
+      }
+      if (evt.window.event == SDL_WINDOWEVENT_EXPOSED) gpu.redraw();
+      break;
+    case SDL_KEYDOWN:
+      switch (evt.key.keysym.sym) {
+        case SDLK_RETURN:
+          send(input, {InputEvent::Press, START});
+          break;
+        case SDLK_SPACE:
+          send(input, {InputEvent::Press, SELECT});
+          break;
+        case SDLK_UP:
+          send(input, {InputEvent::Press, UP});
+          break;
+        case SDLK_DOWN:
+          send(input, {InputEvent::Press, DOWN});
+          break;
+        case SDLK_LEFT:
+          send(input, {InputEvent::Press, LEFT});
+          break;
+        case SDLK_RIGHT:
+          send(input, {InputEvent::Press, RIGHT});
+          break;
+        case SDLK_z:
+          send(input, {InputEvent::Press, B});
+          break;
+        case SDLK_x:
+          send(input, {InputEvent::Press, A});
+          break;
+        case SDLK_BACKSPACE:
+          send(input, {InputEvent::RewindStart});
+          break;
+        case SDLK_TAB:
+          send(input, {InputEvent::TurboStart});
+          break;
+      }
+      break;
+    case SDL_KEYUP:
+      switch (evt.key.keysym.sym) {
+        case SDLK_RETURN:
+          send(input, {InputEvent::Release, START});
+          break;
+        case SDLK_SPACE:
+          send(input, {InputEvent::Release, SELECT});
+          break;
+        case SDLK_UP:
+          send(input, {InputEvent::Release, UP});
+          break;
+        case SDLK_DOWN:
+          send(input, {InputEvent::Release, DOWN});
+          break;
+        case SDLK_LEFT:
+          send(input, {InputEvent::Release, LEFT});
+          break;
+        case SDLK_RIGHT:
+          send(input, {InputEvent::Release, RIGHT});
+          break;
+        case SDLK_z:
+          send(input, {InputEvent::Release, B});
+          break;
+        case SDLK_x:
+          send(input, {InputEvent::Release, A});
+          break;
+        case SDLK_BACKSPACE:
+          send(input, {InputEvent::RewindStop});
+          break;
+        case SDLK_TAB:
+          send(input, {InputEvent::TurboStop});
+          break;
+      }
+      break;
+  }
+  return true;
+}
+
+// wakes the main thread out of SDL_WaitEvent once the emulator thread has
+// published a frame. at most one of its events is ever in SDL's queue
+class FrameSignal {
+ private:
+  Uint32 type_;
+  std::atomic<bool> pending_;
+
+ public:
+  FrameSignal() : type_(SDL_RegisterEvents(1)), pending_(false) {
+    if (type_ == static_cast<Uint32>(-1)) type_ = SDL_USEREVENT;
+  }
+
+  // from the emulator thread
+  void raise() {
+    if (pending_.exchange(true)) return;
+    SDL_Event evt = {};
+    evt.type = type_;
+    SDL_PushEvent(&evt);
+  }
+  // whether evt is the signal, which may then be raised again
+  bool received(const SDL_Event &evt) {
+    if (evt.type != type_) return false;
+    pending_ = false;
+    return true;
+  }
+};
+
+// how run_windowed runs the ROM
+struct WindowedOptions {
+  std::uint64_t max_frames = 0;
+  // how many frames ahead of the emulator the frames shown are
+  std::uint64_t run_ahead = 0;
+  // frames per FRAME_PERIOD, normally and while tab is held; 0 runs as fast
+  // as the emulator can
+  double speed = 1;
+  double turbo_speed = 4;
+  // frames run but not shown after each frame shown
+  std::uint64_t frame_skip = 0;
+};
+
+// the emulator thread: runs the ROM at the speed scheduler paces it to, or
+// goes back a frame at a time while rewinding, until it halts or `running`
+// is cleared. with run_ahead, each frame published is that many frames
+// ahead of the emulator, as the input stands. signal is raised for every
+// frame published and once more on the way out
+static void emulate(Emulator &emu, const Rom &rom,
+                    const WindowedOptions &options, InputQueue &input,
+                    FrameMailbox &frames, FrameSignal &signal,
+                    FrameScheduler &scheduler, std::atomic<bool> &running) {
+  bool rewinding = false;
+  // frames run since the last one shown
+  std::uint64_t skipped = options.frame_skip;
+
+  emu.start_rom(rom);
+  while (running && !emu.is_halted() &&
+         (options.max_frames == 0 ||
+          emu.get_frame_count() < options.max_frames)) {
+    InputEvent event;
+    while (input.pop(event)) {
+      switch (event.kind) {
+        case InputEvent::Press:
+          emu.get_controller().push_button(event.button);
+          break;
+        case InputEvent::Release:
+          emu.get_controller().unpush_button(event.button);
+          break;
+        case InputEvent::RewindStart:
+          rewinding = true;
+          break;
+        case InputEvent::RewindStop:
+          rewinding = false;
+          break;
+        case InputEvent::TurboStart:
+          if (scheduler.get_speed() != options.turbo_speed) {
+            scheduler.set_speed(options.turbo_speed);
+          }
+          break;
+        case InputEvent::TurboStop:
+          scheduler.set_speed(options.speed);
+          break;
+      }
+    }
+
+    if (rewinding) {
+      emu.rewind(1);
+    } else {
+      emu.execute_frame();
+    }
+    if (emu.is_halted()) break;
+
+    // skipped frames neither run ahead nor go to the presenting thread; the
+    // rows they change are still marked for the next frame shown
+    if (skipped < options.frame_skip) {
+      skipped++;
+    } else {
+      skipped = 0;
+      const byte_t *vram =
+          rewinding ? emu.get_vram() : emu.run_ahead(options.run_ahead);
+      std::copy_n(vram, WindowArea, frames.back().vram);
+      frames.publish(emu.take_changed_rows());
+      signal.raise();
+    }
+    scheduler.wait();
+  }
+  running = false;
+  signal.raise();
+}
+
+// runs the ROM in gpu's window, presenting each frame the emulator thread
+// finishes, until the ROM halts or the window is closed. returns how well
+// frames kept to time
+static FrameScheduler::Stats run_windowed(Emulator &emu, Gpu &gpu,
+                                          const Rom &rom,
+                                          const WindowedOptions &options) {
+  InputQueue input;
+  auto frames = std::make_unique<FrameMailbox>();
+  FrameSignal signal;
+  FrameScheduler scheduler(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(FRAME_PERIOD),
+      options.speed);
+  std::atomic<bool> running(true);
+  std::thread emulator(emulate, std::ref(emu), std::cref(rom),
+                       std::cref(options), std::ref(input), std::ref(*frames),
+                       std::ref(signal), std::ref(scheduler),
+                       std::ref(running));
+
+  bool open = true;
+  while (open && running) {
+    // sleeps until there's input or the emulator thread raises the signal
+    SDL_Event evt;
+    if (!SDL_WaitEvent(&evt)) {
+      warn(SDL_GetError());
+      break;
+    }
+    do {
+      if (!signal.received(evt)) open = handle_event(evt, input, gpu);
+    } while (open && SDL_PollEvent(&evt));
+    if (const FrameMailbox::Frame *frame = frames->take()) {
+      gpu.renderFrame(frame->vram, frame->changed_rows);
+    }
+  }
+  // however slow the speed, the emulator thread stops without finishing
+  // its wait for the next frame
+  running = false;
+  scheduler.stop();
+  emulator.join();
+  return scheduler.get_stats();
+}
+
+static int usage(const char *program) {
+  std::cerr << "usage: " << program
+            << " [--core=switch|threaded|jit] [--no-aot] [--headless]"
+               " [--frames=N] [--speed=X] [--turbo=X] [--frame-skip=N]"
+               " [--scale=N] [--renderer] [--rewind=MIB] [--run-ahead=N]"
+               " [--budget=N] [--setup-budget=N]"
+               " [--overrun=abort|carry|drop] [--stats] <rom file>."
+            << std::endl;
+  return 1;
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    std::cerr << "usage: " << argv[0] << " <rom file>." << std::endl;
-    return 1;
+  const char *rom_file = nullptr;
+  InterpreterCore core = InterpreterCore::Switch;
+  bool core_given = false;
+  bool use_aot = true;
+  bool print_stats = false;
+  bool headless = false;
+  std::uint64_t max_frames = 0;
+  std::uint64_t rewind_mib = 0;
+  WindowedOptions windowed;
+  long scale = 4;
+  bool use_renderer = false;
+  InstructionBudget budget;
+
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--core=switch") == 0) {
+      core = InterpreterCore::Switch;
+      core_given = true;
+    } else if (std::strcmp(argv[i], "--core=threaded") == 0) {
+      core = InterpreterCore::Threaded;
+      core_given = true;
+    } else if (std::strcmp(argv[i], "--core=jit") == 0) {
+      core = InterpreterCore::Jit;
+      core_given = true;
+    } else if (std::strcmp(argv[i], "--no-aot") == 0) {
+      use_aot = false;
+    } else if (std::strcmp(argv[i], "--stats") == 0) {
+      print_stats = true;
+    } else if (std::strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (std::strncmp(argv[i], "--frames=", 9) == 0) {
+      char *end;
+      max_frames = std::strtoull(argv[i] + 9, &end, 10);
+      if (*end != '\0' || max_frames == 0) return usage(argv[0]);
+    } else if (std::strncmp(argv[i], "--scale=", 8) == 0) {
+      char *end;
+      scale = std::strtol(argv[i] + 8, &end, 10);
+      if (*end != '\0' || scale < 1 || scale > MAX_BLIT_SCALE) {
+        return usage(argv[0]);
+      }
+    } else if (std::strncmp(argv[i], "--speed=", 8) == 0) {
+      char *end;
+      windowed.speed = std::strtod(argv[i] + 8, &end);
+      if (*end != '\0' || !(windowed.speed >= 0)) return usage(argv[0]);
+    } else if (std::strncmp(argv[i], "--turbo=", 8) == 0) {
+      char *end;
+      windowed.turbo_speed = std::strtod(argv[i] + 8, &end);
+      if (*end != '\0' || !(windowed.turbo_speed >= 0)) {
+        return usage(argv[0]);
+      }
+    } else if (std::strncmp(argv[i], "--frame-skip=", 13) == 0) {
+      char *end;
+      windowed.frame_skip = std::strtoull(argv[i] + 13, &end, 10);
+      if (*end != '\0') return usage(argv[0]);
+    } else if (std::strcmp(argv[i], "--renderer") == 0) {
+      use_renderer = true;
+    } else if (std::strncmp(argv[i], "--rewind=", 9) == 0) {
+      char *end;
+      rewind_mib = std::strtoull(argv[i] + 9, &end, 10);
+      if (*end != '\0' || rewind_mib == 0) return usage(argv[0]);
+    } else if (std::strncmp(argv[i], "--run-ahead=", 12) == 0) {
+      char *end;
+      windowed.run_ahead = std::strtoull(argv[i] + 12, &end, 10);
+      if (*end != '\0') return usage(argv[0]);
+    } else if (std::strncmp(argv[i], "--budget=", 9) == 0) {
+      char *end;
+      budget.frame = std::strtoull(argv[i] + 9, &end, 10);
+      if (*end != '\0' || budget.frame == 0) return usage(argv[0]);
+    } else if (std::strncmp(argv[i], "--setup-budget=", 15) == 0) {
+      char *end;
+      budget.setup = std::strtoull(argv[i] + 15, &end, 10);
+      if (*end != '\0' || budget.setup == 0) return usage(argv[0]);
+    } else if (std::strcmp(argv[i], "--overrun=abort") == 0) {
+      budget.policy = OverrunPolicy::Abort;
+    } else if (std::strcmp(argv[i], "--overrun=carry") == 0) {
+      budget.policy = OverrunPolicy::Carry;
+    } else if (std::strcmp(argv[i], "--overrun=drop") == 0) {
+      budget.policy = OverrunPolicy::Drop;
+    } else if (argv[i][0] == '-' || rom_file != nullptr) {
+      return usage(argv[0]);
+    } else {
+      rom_file = argv[i];
+    }
   }
 
+  if (rom_file == nullptr) return usage(argv[0]);
+
   // std::cout << "pre-init" << std::endl;
-  SDL_Init(SDL_INIT_VIDEO);
+  if (!headless) SDL_Init(SDL_INIT_VIDEO);
   // std::cout << "post-init" << std::endl;
   Emulator emu;
-  Rom r = Rom::ReadRomFile(argv[1]);
+  emu.set_interpreter_core(core);
+  emu.enable_rewind(rewind_mib << 20);
+  emu.set_instruction_budget(budget);
+  Rom r = Rom::ReadRomFile(rom_file);
+
+  // use games/snake.so for games/snake.slug if it was built with recompile
+  std::string recompiled(rom_file);
+  recompiled.replace(recompiled.size() - 5, 5, ".so");
+  if (use_aot && !core_given && access(recompiled.c_str(), R_OK) == 0 &&
+      emu.load_recompiled_rom(recompiled, r)) {
+    emu.set_interpreter_core(InterpreterCore::Aot);
+  }
   // std::cout << "pre-execute" << std::endl;
-  try {
-    emu.execute_rom(r);
-  } catch (StopException e) {
-    return 0;
+  auto start = std::chrono::steady_clock::now();
+  FrameScheduler::Stats pacing = {};
+  if (headless) {
+    emu.execute_rom(r, max_frames);
+  } else {
+    Gpu gpu(scale, use_renderer);
+    windowed.max_frames = max_frames;
+    pacing = run_windowed(emu, gpu, r, windowed);
   }
   // std::cout << "post-execute" << std::endl;
+
+  if (print_stats) {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cerr << emu.get_instruction_count() << " instructions in "
+              << elapsed.count() << " s ("
+              << emu.get_instruction_count() / elapsed.count()
+              << " instructions/s), " << emu.get_frame_count()
+              << " frames (" << emu.get_frame_count() / elapsed.count()
+              << " frames/s)" << std::endl;
+    BudgetStats usage = emu.get_budget_stats();
+    std::cerr << "setup ran " << usage.setup_instructions
+              << " instructions, frames up to "
+              << usage.max_frame_instructions << " (" << usage.overruns
+              << " over budget)" << std::endl;
+    if (emu.get_idle_frame_count() > 0) {
+      std::cerr << emu.get_idle_frame_count()
+                << " frames ended early in idle loops" << std::endl;
+    }
+    if (pacing.paced_frames > 0) {
+      std::cerr << "pacing: frames started " << pacing.mean_jitter_us
+                << " us late on average, " << pacing.max_jitter_us
+                << " us at worst; " << pacing.late_frames
+                << " a whole frame late" << std::endl;
+    }
+    RewindBuffer::Stats rewind = emu.get_rewind_stats();
+    if (rewind.reserved_bytes > 0) {
+      std::cerr << "rewind: " << rewind.states << " states back to frame "
+                << rewind.oldest_frame << " in " << rewind.used_bytes
+                << " bytes (" << rewind.reserved_bytes << " reserved)"
+                << std::endl;
+    }
+  }
   return 0;
 }